@@ -0,0 +1,486 @@
+/* vim:set cin ft=c sw=4 sts=4 ts=8 et ai cino=Ls\:0t0(0 : -*- mode:c;fill-column:80;tab-width:8;c-basic-offset:4;indent-tabs-mode:nil;c-file-style:"k&r" -*-*/
+/* NetHack may be freely redistributed.  See license for details. */
+
+/* A benchmark for the save system. Each logfile in the given directory is
+   replayed, seeking to every turn in turn (which goes via log_sync), while
+   libnethack reports how long each phase of save handling took. (Replays
+   don't write save diffs, so while timing, libnethack diffs each gamestate it
+   loads against the one before, as it would have when the game was played;
+   that's what the "diff" phase measures.) The results are printed as one JSON
+   object per line: one per game, then one for all the games together.
+
+   This is only built if aimake's "benchmark" feature is enabled. */
+
+#ifdef AIMAKE_BUILDOS_MSWin32
+# error !AIMAKE_FAIL_SILENTLY! Benchmarking on Windows is not yet supported.
+#endif
+
+#include "nethack.h"
+#include "menulist.h"
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <errno.h>
+
+/* The timings for one phase: samples are kept so that percentiles can be
+   calculated. Seeking (as seen from outside libnethack) is timed too. */
+#define PHASE_SEEK SAVEPHASE_COUNT
+#define PHASE_COUNT (SAVEPHASE_COUNT + 1)
+
+static const char *const phase_names[PHASE_COUNT] = {
+    [SAVEPHASE_SAVEGAME] = "savegame",
+    [SAVEPHASE_DORECOVER] = "dorecover",
+    [SAVEPHASE_DIFF] = "diff",
+    [SAVEPHASE_DIFFAPPLY] = "diffapply",
+    [SAVEPHASE_MEQUAL] = "mequal",
+    [SAVEPHASE_BASE64] = "base64",
+    [SAVEPHASE_ZLIB] = "zlib",
+    [PHASE_SEEK] = "seek",
+};
+
+struct phase_timings {
+    long long *samples;
+    int count, size;
+    long long total_ns;
+    long long total_bytes;
+};
+
+struct game_timings {
+    struct phase_timings phases[PHASE_COUNT];
+    long long bytes, lines, turns, ns;
+};
+
+static struct game_timings this_game, all_games;
+
+static char temp_directory[] = "nethack4-benchmark-XXXXXX\0";
+
+/* The replay is driven by seeking to each turn in order, after first seeking
+   to the end to find out how many turns there are. */
+static enum { SEEK_TO_END, SEEK_TO_TURN } bench_state;
+static int current_moves, final_moves, target_turn;
+static long long seek_started;
+
+static long long
+now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* Recording and reporting timings. */
+
+static void
+add_sample(struct phase_timings *pt, long long ns, long bytes)
+{
+    if (pt->count == pt->size) {
+        pt->size = pt->size ? pt->size * 2 : 256;
+        pt->samples = realloc(pt->samples, pt->size * sizeof *pt->samples);
+        if (!pt->samples) {
+            perror("benchmain");
+            exit(EXIT_FAILURE);
+        }
+    }
+    pt->samples[pt->count++] = ns;
+    pt->total_ns += ns;
+    pt->total_bytes += bytes;
+}
+
+static void
+record_phase(enum nh_save_phase phase, long long ns, long bytes)
+{
+    add_sample(&this_game.phases[phase], ns, bytes);
+    add_sample(&all_games.phases[phase], ns, bytes);
+}
+
+static int
+compare_samples(const void *a, const void *b)
+{
+    long long x = *(const long long *)a, y = *(const long long *)b;
+    return x < y ? -1 : x > y;
+}
+
+static long long
+percentile(const struct phase_timings *pt, int p)
+{
+    if (!pt->count)
+        return 0;
+    return pt->samples[(long long)(pt->count - 1) * p / 100];
+}
+
+static void
+print_timings(const char *game, struct game_timings *gt)
+{
+    int i;
+
+    printf("{\"game\": \"%s\", \"bytes\": %lld, \"lines\": %lld, "
+           "\"turns\": %lld, \"seconds\": %.6f, "
+           "\"bytes_per_turn\": %.1f, \"lines_per_second\": %.1f, "
+           "\"phases\": {", game, gt->bytes, gt->lines, gt->turns,
+           gt->ns / 1e9, gt->turns ? (double)gt->bytes / gt->turns : 0.0,
+           gt->ns ? gt->lines / (gt->ns / 1e9) : 0.0);
+
+    for (i = 0; i < PHASE_COUNT; i++) {
+        struct phase_timings *pt = &gt->phases[i];
+
+        qsort(pt->samples, pt->count, sizeof *pt->samples, compare_samples);
+        printf("%s\"%s\": {\"count\": %d, \"total_ns\": %lld, "
+               "\"bytes_per_turn\": %.1f, \"p50_ns\": %lld, "
+               "\"p90_ns\": %lld, \"p99_ns\": %lld, \"max_ns\": %lld}",
+               i ? ", " : "", phase_names[i], pt->count, pt->total_ns,
+               gt->turns ? (double)pt->total_bytes / gt->turns : 0.0,
+               percentile(pt, 50), percentile(pt, 90), percentile(pt, 99),
+               percentile(pt, 100));
+    }
+
+    printf("}}\n");
+    fflush(stdout);
+}
+
+static void
+reset_timings(struct game_timings *gt)
+{
+    int i;
+
+    for (i = 0; i < PHASE_COUNT; i++)
+        free(gt->phases[i].samples);
+    memset(gt, 0, sizeof *gt);
+}
+
+/* Window procedures. Only the status (for the turn counter) and command
+   requests (to drive the replay) matter; everything else is ignored, apart
+   from deallocating menulists as the API requires. */
+
+static void
+bench_request_command(nh_bool debug, nh_bool completed, nh_bool interrupted,
+                      void *callbackarg,
+                      void (*callback)(const struct nh_cmd_and_arg *, void *))
+{
+    (void) debug;
+    (void) completed;
+    (void) interrupted;
+
+    if (bench_state == SEEK_TO_END) {
+        final_moves = current_moves;
+        bench_state = SEEK_TO_TURN;
+        target_turn = 0;
+    } else {
+        add_sample(&this_game.phases[PHASE_SEEK], now_ns() - seek_started, 0);
+        add_sample(&all_games.phases[PHASE_SEEK], now_ns() - seek_started, 0);
+    }
+
+    if (++target_turn > final_moves)
+        nh_exit_game(EXIT_SAVE);        /* doesn't return */
+
+    seek_started = now_ns();
+    callback(&(struct nh_cmd_and_arg){
+            "wait", {.argtype = CMD_ARG_LIMIT, .limit = target_turn}},
+        callbackarg);
+}
+
+static void
+bench_update_status(struct nh_player_info *pi)
+{
+    current_moves = pi->moves;
+}
+
+static void
+bench_display_menu(struct nh_menulist *ml, const char *title, int how,
+                   int placement_hint, void *callbackarg,
+                   void (*callback)(const int *, int, void *))
+{
+    (void) title;
+    (void) how;
+    (void) placement_hint;
+    dealloc_menulist(ml);
+    callback(NULL, -1, callbackarg);
+}
+
+static void
+bench_display_objects(struct nh_objlist *ml, const char *title, int how,
+                      int placement_hint, void *callbackarg,
+                      void (*callback)(const struct nh_objresult *, int,
+                                       void *))
+{
+    (void) title;
+    (void) how;
+    (void) placement_hint;
+    dealloc_objmenulist(ml);
+    callback(NULL, -1, callbackarg);
+}
+
+static void
+bench_list_items(struct nh_objlist *ml, nh_bool invent)
+{
+    (void) invent;
+    dealloc_objmenulist(ml);
+}
+
+static void
+bench_outrip(struct nh_menulist *ml, nh_bool tombstone, const char *name,
+             int gold, const char *killbuf, int end_how, int year)
+{
+    (void) tombstone;
+    (void) name;
+    (void) gold;
+    (void) killbuf;
+    (void) end_how;
+    (void) year;
+    dealloc_menulist(ml);
+}
+
+static struct nh_query_key_result
+bench_query_key(const char *query, enum nh_query_key_flags flags,
+                nh_bool count_allowed)
+{
+    (void) query;
+    (void) flags;
+    (void) count_allowed;
+    return (struct nh_query_key_result){.key = '\x1b', .count = -1};
+}
+
+static struct nh_getpos_result
+bench_getpos(int x, int y, nh_bool force, const char *goal)
+{
+    (void) force;
+    (void) goal;
+    return (struct nh_getpos_result){.howclosed = NHCR_CLIENT_CANCEL,
+            .x = x, .y = y};
+}
+
+static enum nh_direction
+bench_getdir(const char *query, nh_bool restricted)
+{
+    (void) query;
+    (void) restricted;
+    return DIR_NONE;
+}
+
+static char
+bench_yn_function(const char *query, const char *answers, char default_answer)
+{
+    (void) query;
+    (void) answers;
+    return default_answer;
+}
+
+static void
+bench_getlin(const char *query, void *callbackarg,
+             void (*callback)(const char *, void *))
+{
+    (void) query;
+    callback("\x1b", callbackarg);
+}
+
+static void
+bench_pause(enum nh_pause_reason reason)
+{
+    (void) reason;
+}
+
+static void
+bench_display_buffer(const char *buf, nh_bool trymove)
+{
+    (void) buf;
+    (void) trymove;
+}
+
+static void
+bench_print_message(enum msg_channel msgc, const char *message)
+{
+    (void) msgc;
+    (void) message;
+}
+
+static void
+bench_update_screen(struct nh_dbuf_entry dbuf[ROWNO][COLNO], int ux, int uy)
+{
+    (void) dbuf;
+    (void) ux;
+    (void) uy;
+}
+
+static void
+bench_raw_print(const char *message)
+{
+    fprintf(stderr, "%s\n", message);
+}
+
+static void
+bench_no_op_void(void)
+{
+}
+
+static void
+bench_no_op_int(int unused)
+{
+    (void) unused;
+}
+
+static struct nh_window_procs bench_windowprocs = {
+    .win_pause = bench_pause,
+    .win_display_buffer = bench_display_buffer,
+    .win_update_status = bench_update_status,
+    .win_print_message = bench_print_message,
+    .win_request_command = bench_request_command,
+    .win_display_menu = bench_display_menu,
+    .win_display_objects = bench_display_objects,
+    .win_list_items = bench_list_items,
+    .win_update_screen = bench_update_screen,
+    .win_raw_print = bench_raw_print,
+    .win_query_key = bench_query_key,
+    .win_getpos = bench_getpos,
+    .win_getdir = bench_getdir,
+    .win_yn_function = bench_yn_function,
+    .win_getlin = bench_getlin,
+    .win_delay = bench_no_op_void,
+    .win_load_progress = bench_no_op_int,
+    .win_level_changed = bench_no_op_int,
+    .win_outrip = bench_outrip,
+    .win_server_cancel = bench_no_op_void
+};
+
+/* Benchmarking. */
+
+static void
+benchmark_game(const char *filename)
+{
+    struct nh_game_info gi;
+    enum nh_log_status status;
+    enum nh_play_status ret;
+    long long started;
+    char buf[4096];
+    ssize_t len;
+    int fd;
+
+    fd = open(filename, O_RDWR);
+    if (fd < 0) {
+        fprintf(stderr, "%s: %s\n", filename, strerror(errno));
+        return;
+    }
+
+    status = nh_get_savegame_status(fd, &gi);
+    if (status != LS_SAVED && status != LS_DONE) {
+        fprintf(stderr, "%s: not a usable logfile\n", filename);
+        close(fd);
+        return;
+    }
+
+    reset_timings(&this_game);
+    while ((len = read(fd, buf, sizeof buf)) > 0) {
+        this_game.bytes += len;
+        for (ssize_t i = 0; i < len; i++)
+            if (buf[i] == '\n')
+                this_game.lines++;
+    }
+    lseek(fd, 0, SEEK_SET);
+
+    bench_state = SEEK_TO_END;
+    current_moves = final_moves = 0;
+
+    started = now_ns();
+    ret = nh_play_game(fd, FM_REPLAY);
+    this_game.ns = now_ns() - started;
+    this_game.turns = final_moves;
+    close(fd);
+
+    if (ret != GAME_DETACHED) {
+        fprintf(stderr, "%s: replay failed (status %d)\n", filename, ret);
+        return;
+    }
+
+    all_games.bytes += this_game.bytes;
+    all_games.lines += this_game.lines;
+    all_games.turns += this_game.turns;
+    all_games.ns += this_game.ns;
+
+    print_timings(filename, &this_game);
+}
+
+static int
+is_not_hidden(const struct dirent *d)
+{
+    return d->d_name[0] != '.';
+}
+
+int
+main(int argc, char **argv)
+{
+    struct dirent **files;
+    int nfiles, i;
+
+    if (argc != 2) {
+        fprintf(stderr, "Usage: benchmain directory\n");
+        return EXIT_FAILURE;
+    }
+
+    nfiles = scandir(argv[1], &files, is_not_hidden, alphasort);
+    if (nfiles < 0) {
+        perror(argv[1]);
+        return EXIT_FAILURE;
+    }
+
+    if (!mkdtemp(temp_directory)) {
+        perror("Creating a temporary directory");
+        return EXIT_FAILURE;
+    }
+    /* this is safe because we have an extra \0 at the end */
+    temp_directory[strlen(temp_directory)] = '/';
+
+    const char *gsd = aimake_get_option("gamesdatadir");
+    size_t gsdlen = strlen(gsd);
+    char gsd_with_slash[gsdlen + 2];
+    strcpy(gsd_with_slash, gsd);
+    if (gsdlen && gsd[gsdlen - 1] != '/') {
+        gsd_with_slash[gsdlen] = '/';
+        gsd_with_slash[gsdlen + 1] = '\0';
+    }
+
+    const char *paths[PREFIX_COUNT] = {
+        [BONESPREFIX] = "$OMIT",
+        [DATAPREFIX] = gsd_with_slash,
+        [SCOREPREFIX] = temp_directory,
+        [LOCKPREFIX] = temp_directory,
+        [TROUBLEPREFIX] = temp_directory,
+        [DUMPPREFIX] = "$OMIT",
+    };
+
+    nh_lib_init(&bench_windowprocs, paths);
+    nh_set_save_timing_callback(record_phase);
+
+    for (i = 0; i < nfiles; i++) {
+        size_t pathlen = strlen(argv[1]) + strlen(files[i]->d_name) + 2;
+        char path[pathlen];
+        snprintf(path, pathlen, "%s/%s", argv[1], files[i]->d_name);
+        benchmark_game(path);
+        free(files[i]);
+    }
+    free(files);
+
+    print_timings("(all)", &all_games);
+
+    nh_set_save_timing_callback(NULL);
+    nh_lib_exit();
+    reset_timings(&this_game);
+    reset_timings(&all_games);
+
+    /* Clean up anything the games left in the temporary directory. */
+    const char *const tempfiles[] = {"paniclog", "logfile", "xlogfile",
+                                     "record"};
+    for (i = 0; i < (int)(sizeof tempfiles / sizeof *tempfiles); i++) {
+        char tempfile[strlen(temp_directory) + strlen(tempfiles[i]) + 1];
+        strcpy(tempfile, temp_directory);
+        strcat(tempfile, tempfiles[i]);
+        remove(tempfile);
+    }
+    rmdir(temp_directory);
+
+    return EXIT_SUCCESS;
+}
@@ -336,6 +336,7 @@ extern struct sinfo {
     boolean restoring_binary_save;
     boolean in_zero_time_command;
     boolean eof_reached;
+    boolean verifying_save_in_background; /* we're a save-checking child */
 
     /*
      * Invariants:
@@ -606,6 +606,7 @@ extern int delete_bonesfile(char *bonesid);
 extern void paniclog(const char *, const char *);
 extern boolean change_fd_lock(int fd, boolean on_logfile,
                               enum locktype type, int timeout);
+extern unsigned int get_fd_lock_changes(void);
 extern void flush_logfile_watchers(void);
 
 /* ### fountain.c ### */
@@ -797,6 +798,8 @@ extern void log_neutral_turnstate(void);
 extern void log_backup_save(void);
 
 extern void log_sync(long, enum target_location_units, boolean);
+extern void log_stop_pipeline(void);
+extern boolean log_paranoid_saves(void);
 
 extern void log_revert_command(const char *);
 extern void log_recover_core(long, boolean, const char *, const char *, int);
@@ -881,6 +884,7 @@ extern void store_mf(int fd, struct memfile *mf);
 extern void mtag(struct memfile *mf, long tagdata,
                  enum memfile_tagtype tagtype);
 extern void mhint_mon_coordinates(struct memfile *mf);
+extern void mhint_length(struct memfile *mf, long len);
 extern void mdiffflush(struct memfile *mf, boolean eof);
 extern void mdiffapply(char *diff, long difflen, struct memfile *diff_base,
                        struct memfile *new_memfile,
@@ -1226,6 +1230,10 @@ extern int do_play_instrument(struct obj *, const struct nh_cmd_arg *);
 
 enum rng rng_for_level(const d_level *);
 int mklev_rn2(int, struct level *);
+# ifdef RNG_PROFILE
+#  define mklev_rn2(x, lev) RNG_PROFILE_SITE(mklev_rn2((x), (lev)))
+# endif
+boolean write_rng_profile(void);
 
 /* ### o_init.c ### */
 
@@ -1522,6 +1530,13 @@ extern void savegame(struct memfile *mf);
 extern void save_coords(struct memfile *mf, const coord *c, int n);
 extern void savelev(struct memfile *mf, xchar levnum);
 extern void freelev(xchar levnum);
+extern void discard_level_save_cache(xchar levnum);
+extern void mark_level_changed(const struct level *lev);
+extern void mark_gamestate_changed(void);
+extern unsigned long gamestate_change_count(void);
+extern void verify_level_save_cache(const struct memfile *mf, xchar levnum,
+                                    int startpos);
+extern void free_level_save_cache(void);
 extern void savefruitchn(struct memfile *mf);
 extern void freedynamicdata(void);
 extern int8_t save_encode_8(int8_t, int, int);
@@ -1531,6 +1546,11 @@ extern int8_t save_decode_8(int8_t, int, int);
 extern int16_t save_decode_16(int16_t, int, int);
 extern int32_t save_decode_32(int32_t, int, int);
 
+/* ### script.c ### */
+
+extern boolean start_script_profile(void);
+extern boolean write_script_profile(void);
+
 /* ### shk.c ### */
 
 extern long money2mon(struct monst *, long);
@@ -1833,9 +1853,11 @@ extern void vision_init(void);
 extern int does_block(struct level *lev, int x, int y);
 extern void vision_reset(void);
 extern void vision_recalc(int);
+extern unsigned long vision_clear_gen(void);
 extern void block_point(int, int);
 extern void unblock_point(int, int);
 extern boolean clear_path(int, int, int, int, char **);
+extern void clear_path_stats(unsigned long *, unsigned long *);
 extern void do_clear_area(int, int, int, void (*)(int, int, void *), void *);
 
 /* ### weapon.c ### */
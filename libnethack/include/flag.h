@@ -224,6 +224,10 @@ struct flag {
         saveenc_moverel = 1,    /* relative to moves */
         saveenc_levelrel = 2    /* relative to level->lastmoves */
     } save_encoding;    /* allows safe conversion of old saves */
+    enum {
+        rngmode_legacy = 0,     /* one random number per SHA-256 hash */
+        rngmode_buffered = 1    /* each hash provides eight 32-bit words */
+    } rng_mode;         /* old games keep the RNG they were started with */
 
 # define DISCLOSE_PROMPT_DEFAULT_YES    'y'
 # define DISCLOSE_PROMPT_DEFAULT_NO     'n'
@@ -293,6 +297,10 @@ struct flag {
     /* Note: for backwards compatibility, this has its own section in the save
        file. */
     unsigned char rngstate[RNG_SEEDSPACE];
+    /* With rngmode_buffered, the number of words of each RNG's most recent
+       hash that haven't been used yet. The words themselves aren't saved, as
+       they can be recalculated from the seed. */
+    unsigned char rngavail[RNG_COUNT];
 
     /* === MULTI-TURN COMMAND STATE === */
 
@@ -9,6 +9,7 @@
 # define LEV_H
 
 # include "global.h"
+# include "vision.h"
 
 /* The following are used in mkmaze.c */
 struct container {
@@ -39,6 +40,14 @@ typedef struct ls_t {
     short flags;
     short type; /* type of light source */
     void *id;   /* source's identifier */
+
+    /* The area the source lit last time (see do_light_sources()); this is not
+       saved.  Bit dx + range of lit_rows[dy + range] is set if (x+dx, y+dy) is
+       lit. */
+    xchar lit_x, lit_y;         /* position it was lit from */
+    short lit_range;            /* range it was lit with; 0 if not known */
+    unsigned long lit_gen;      /* vision_clear_gen() at the time */
+    uint32_t lit_rows[2 * MAX_RADIUS + 1];
 } light_source;
 
 extern int n_dgns;
@@ -135,6 +135,14 @@ struct memfile_tag {
     enum memfile_tagtype tagtype;
     int pos;
 };
+/* Tags are allocated from an arena owned by the memfile, a block at a time,
+   rather than individually; a save has one tag per object, monster, etc. */
+struct memfile_tag_block {
+    struct memfile_tag_block *next;
+    int used;
+    int size;
+    struct memfile_tag tags[];
+};
 struct memfile {
     /* The basic information: the buffer, its length, and the file position */
     char *buf;
@@ -187,6 +195,8 @@ struct memfile {
     /* Tags to help in diffing. This is a hashtable for efficiency, using
        chaining in the case of collisions. */
     struct memfile_tag *tags[MEMFILE_HASHTABLE_SIZE];
+    struct memfile_tag_block *tag_blocks;       /* newest first */
+    int tagcount;
 
     /* Where we are "semantically", for debug purposes. (It's possible this
        could someday be used to construct better error messages, too, but so
@@ -135,6 +135,7 @@ enum rng {
     rng_trapdoor_result, /* distance to get trapdoored */
     first_level_rng
 };
+#define RNG_COUNT (first_level_rng + NUMBER_OF_LEVEL_RNGS)
 
 static_assert((first_level_rng + NUMBER_OF_LEVEL_RNGS) *
               RNG_SEED_SIZE_BYTES <= RNG_SEEDSPACE,
@@ -204,6 +205,32 @@ int rnz_on_rng(int i, enum rng rng);
 
 int rnz(int i);
 
+/* RNG profiling. If RNG_PROFILE is defined, newrng.c counts how many random
+   numbers are drawn, and how many hashes that takes, for each RNG and for each
+   call site. The call site is captured by wrapping the RNG functions in macros,
+   which therefore have to come after the definitions above. (The site is set
+   via a function call, so that two RNG calls in one expression are merely
+   indeterminately sequenced; both are normally on the same line anyway.) */
+# ifdef RNG_PROFILE
+extern void rng_profile_site(const char *, int);
+#  define RNG_PROFILE_SITE(call) \
+    (rng_profile_site(__FILE__, __LINE__), (call))
+
+#  define rn2_on_rng(x, rng)    RNG_PROFILE_SITE(rn2_on_rng((x), (rng)))
+#  define rnl(x)                RNG_PROFILE_SITE(rnl(x))
+#  define rn2_on_display_rng(x) RNG_PROFILE_SITE(rn2_on_display_rng(x))
+#  define rn2(x)                RNG_PROFILE_SITE(rn2(x))
+#  define rnd(x)                RNG_PROFILE_SITE(rnd(x))
+#  define dice(n, x)            RNG_PROFILE_SITE(dice((n), (x)))
+#  define rne_on_rng(x, rng)    RNG_PROFILE_SITE(rne_on_rng((x), (rng)))
+#  define rne(x)                RNG_PROFILE_SITE(rne(x))
+#  define rnz_on_rng(i, rng)    RNG_PROFILE_SITE(rnz_on_rng((i), (rng)))
+#  define rnz(i)                RNG_PROFILE_SITE(rnz(i))
+#  define randn_on_rng(rng)     RNG_PROFILE_SITE(randn_on_rng(rng))
+#  define randn()               RNG_PROFILE_SITE(randn())
+#  define dice_normal(n, x)     RNG_PROFILE_SITE(dice_normal((n), (x)))
+# endif
+
 #endif
 
 /*rnd.h*/
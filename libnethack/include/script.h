@@ -8,11 +8,29 @@
 extern lua_State* Lua;
 int start_Lua();
 
-#define sig_table_size 3
+// The allocator that start_Lua() gives to Lua (see lua_Alloc). It fails any
+// request that would take Lua's memory use over the limit.
+#define DEFAULT_LUA_MEMORY_LIMIT (64 * 1024 * 1024)
+void* script_alloc(void* ud, void* ptr, size_t osize, size_t nsize);
+
+// Hooks that the game calls in the ruleset. These are in the same order as
+// sig_table; start_Lua() looks each one up once, so that calling a hook via
+// script_call_hook() doesn't need to find the function again.
+enum script_hook {
+    HOOK_HP_LOSS_MODIFIER,
+    HOOK_ROOM_NUMBER_OF_ITEMS,
+    HOOK_ROOM_GEN_ALTAR,
+    HOOK_ROOM_GEN_FOUNTAIN,
+    HOOK_ROOM_GEN_SINK,
+    HOOK_COUNT
+};
+
+#define sig_table_size HOOK_COUNT
 extern const char* sig_table[][2];
 
 const char* get_sig(const char* func);
 void script_call(const char *func, ...);
+void script_call_hook(enum script_hook hook, ...);
 
 int luaopen_nethacklib(lua_State* L);
 
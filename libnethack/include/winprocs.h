@@ -15,6 +15,7 @@ extern struct nh_window_procs windowprocs;
 # define update_status (*windowprocs.win_update_status)
 # define print_message (*windowprocs.win_print_message)
 # define update_screen (*windowprocs.win_update_screen)
+# define update_screen_delta (*windowprocs.win_update_screen_delta)
 # define raw_print (*windowprocs.win_raw_print)
 # define outrip (*windowprocs.win_outrip)
 # define level_changed (*windowprocs.win_level_changed)
@@ -42,7 +42,15 @@ nh_lib_init(const struct nh_window_procs *procs, const char *const *paths)
     int i;
 
     DEBUG_LOG("Initializing NetHack engine...\n");
-    
+
+    API_ENTRY_CHECKPOINT_RETURN_VOID_ON_ERROR();
+    windowprocs = *procs;
+
+    for (i = 0; i < PREFIX_COUNT; i++)
+        fqn_prefix[i] = strdup(paths[i]);
+
+    /* the ruleset is loaded from the data library, so this needs the paths */
+    dlb_init();
     if (start_Lua() != LUA_OK) {
         printf("Error starting lua. Exiting...\n");
         printf("%s\n", lua_tostring(Lua, -1));
@@ -54,12 +62,6 @@ nh_lib_init(const struct nh_window_procs *procs, const char *const *paths)
         printf("b = %d\n", b);
     }*/
 
-    API_ENTRY_CHECKPOINT_RETURN_VOID_ON_ERROR();
-    windowprocs = *procs;
-
-    for (i = 0; i < PREFIX_COUNT; i++)
-        fqn_prefix[i] = strdup(paths[i]);
-
     u.uhp = 1;  /* prevent RIP on early quits */
 
 #ifdef AIMAKE_BUILDOS_linux
@@ -86,6 +88,13 @@ nh_lib_exit(void)
 
     xmalloc_cleanup(&api_blocklist);
 
+    /* if RNG profiling is compiled in, record the totals for this process */
+    write_rng_profile();
+
+    /* likewise the ruleset hook profile, if the operator asked for it */
+    if (getenv("NH4LUAPROFILE"))
+        write_script_profile();
+
     for (i = 0; i < PREFIX_COUNT; i++) {
         free(fqn_prefix[i]);
         fqn_prefix[i] = NULL;
@@ -329,6 +338,11 @@ nh_create_game(int fd, struct nh_option_desc *opts_orig)
     } else
         seed_rng_from_entropy();
 
+    /* Old games keep using the RNG mode they were created with (the zero
+       padding in their saves reads as rngmode_legacy); new games get the
+       current one. */
+    flags.rng_mode = rngmode_buffered;
+
     if (wizard)
         strcpy(u.uplname, "wizard");
     if (!*u.uplname && discover)
@@ -547,7 +561,13 @@ just_reloaded_save:
         if (program_state.followmode != FM_PLAY && command_from_user &&
             !(cmdlist[cmdidx].flags & CMD_NOTIME)) {
 
-            /* TODO: Add a "seek to specific turn" command */
+            /* Waiting with a count seeks to that turn. */
+            if (program_state.followmode == FM_REPLAY &&
+                cmdidx == get_command_idx("wait") &&
+                cmd.arg.argtype & CMD_ARG_LIMIT && cmd.arg.limit > 0) {
+                log_sync(cmd.arg.limit, TLU_TURNS, FALSE);
+                goto just_reloaded_save;
+            }
 
             /* If we got a direction as part of the command, and we're
                replaying, move forwards or backwards respectively. */
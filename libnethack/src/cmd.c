@@ -47,6 +47,8 @@ static int wiz_mon_polycontrol(const struct nh_cmd_arg *);
 static int wiz_togglegen(const struct nh_cmd_arg *);
 static int wiz_show_wmodes(const struct nh_cmd_arg *);
 static int wiz_show_stats(const struct nh_cmd_arg *);
+static int wiz_rng_profile(const struct nh_cmd_arg *);
+static int wiz_lua_profile(const struct nh_cmd_arg *);
 static void count_obj(struct obj *, long *, long *, boolean, boolean);
 static void obj_chain(struct nh_menulist *, const char *, struct obj *, long *,
                       long *);
@@ -257,6 +259,9 @@ const struct cmd_desc cmdlist[] = {
      wiz_light_sources, CMD_DEBUG | CMD_EXT | CMD_NOTIME},
     {"levelteleport", "(DEBUG) telport to a different level", C('v'), 0, TRUE,
      wiz_level_tele, CMD_DEBUG},
+    {"luaprofile", "(DEBUG) time ruleset hooks, or write the timings out",
+     0, 0, TRUE,
+     wiz_lua_profile, CMD_DEBUG | CMD_NOTIME | CMD_EXT},
     {"monpolycontrol", "(DEBUG) control monster polymorphs", 0, 0, TRUE,
      wiz_mon_polycontrol, CMD_DEBUG | CMD_EXT},
     {"panic", "(DEBUG) test fatal error handling", 0, 0, TRUE,
@@ -267,6 +272,8 @@ const struct cmd_desc cmdlist[] = {
      CMD_DEBUG | CMD_NOTIME | CMD_EXT},
     {"rewind", "(DEBUG) permanently undo gamestate changes", 0, 0, TRUE,
      wiz_rewind, CMD_DEBUG | CMD_NOTIME | CMD_EXT},
+    {"rngprofile", "(DEBUG) write RNG usage counts to a file", 0, 0, TRUE,
+     wiz_rng_profile, CMD_DEBUG | CMD_NOTIME | CMD_EXT},
     {"seenv", "(DEBUG) show seen vectors", 0, 0, TRUE, wiz_show_seenv,
      CMD_DEBUG | CMD_EXT | CMD_NOTIME},
     {"showmap", "(DEBUG) reveal the entire map", 0, 0, TRUE, wiz_map,
@@ -662,6 +669,7 @@ wiz_show_vision(const struct nh_cmd_arg *arg)
     struct nh_menulist menu;
     int x, y, v;
     char row[COLNO + 1] = {0};
+    unsigned long lookups, paths;
 
     (void) arg;
 
@@ -669,6 +677,9 @@ wiz_show_vision(const struct nh_cmd_arg *arg)
     snprintf(row, SIZE(row), "Flags: 0x%x could see, 0x%x in sight, 0x%x temp lit, 0x8 tile lit",
             COULD_SEE, IN_SIGHT, TEMP_LIT);
     add_menutext(&menu, row);
+    clear_path_stats(&lookups, &paths);
+    add_menutext(&menu, msgprintf("Line of sight: %lu lookups, %lu paths drawn",
+                                  lookups, paths));
     add_menutext(&menu, "");
     for (y = 0; y < ROWNO; y++) {
         for (x = 0; x < COLNO; x++) {
@@ -1462,6 +1473,42 @@ wiz_show_stats(const struct nh_cmd_arg *arg)
     return 0;
 }
 
+/*
+ * Write counts of random numbers drawn, per RNG and per call site. This only
+ * does anything in builds with RNG_PROFILE defined.
+ */
+static int
+wiz_rng_profile(const struct nh_cmd_arg *arg)
+{
+    (void) arg;
+
+    if (write_rng_profile())
+        pline(msgc_info, "RNG usage written to rngprofile.txt.");
+    else
+        pline(msgc_cancelled, "No RNG profile could be written (this needs "
+              "a build with RNG_PROFILE defined).");
+    return 0;
+}
+
+/*
+ * The first use starts timing the ruleset's hooks; after that, write their call
+ * counts and timings, and the memory used by Lua.
+ */
+static int
+wiz_lua_profile(const struct nh_cmd_arg *arg)
+{
+    (void) arg;
+
+    if (start_script_profile())
+        pline(msgc_info, "Ruleset hook calls are now being timed.  "
+              "Use #luaprofile again to write the timings out.");
+    else if (write_script_profile())
+        pline(msgc_info, "Ruleset hook timings written to luaprofile.txt.");
+    else
+        pline(msgc_cancelled, "Could not write luaprofile.txt.");
+    return 0;
+}
+
 boolean
 dir_to_delta(enum nh_direction dir, schar * dx, schar * dy, schar * dz)
 {
@@ -1298,6 +1298,18 @@ doredraw(void)
 /* Display Buffering (3rd screen) ========================================== */
 static struct nh_dbuf_entry dbuf[ROWNO][COLNO];
 
+/* The locations whose dbuf entries have changed since they were last sent to
+   the window port, one bit each, and the smallest box around them (empty when
+   dbuf_lx > dbuf_hx). */
+static unsigned char dbuf_changed[ROWNO][(COLNO + 7) / 8];
+static int dbuf_lx = COLNO, dbuf_ly = ROWNO, dbuf_hx = -1, dbuf_hy = -1;
+
+/* the changed entries, for win_update_screen_delta */
+static struct nh_dbuf_delta dbuf_delta[ROWNO * COLNO];
+
+static void dbuf_mark(int x, int y);
+static void dbuf_send(int ux, int uy);
+
 
 /* The game engine internally uses object types, but for presenting objects to
    the user, we need to ensure that the images we show the user match up with
@@ -1455,23 +1467,50 @@ obfuscate_object(int otyp)
 }
 
 
+/*
+ * Note that a location's dbuf entry has changed.
+ */
+static void
+dbuf_mark(int x, int y)
+{
+    dbuf_changed[y][x >> 3] |= 1 << (x & 7);
+    if (x < dbuf_lx)
+        dbuf_lx = x;
+    if (x > dbuf_hx)
+        dbuf_hx = x;
+    if (y < dbuf_ly)
+        dbuf_ly = y;
+    if (y > dbuf_hy)
+        dbuf_hy = y;
+}
+
+
 void
 dbuf_set_effect(int x, int y, int eglyph)
 {
     if (!isok(x, y))
         return;
 
-    dbuf[y][x].effect = eglyph;
+    if (dbuf[y][x].effect != eglyph) {
+        dbuf[y][x].effect = eglyph;
+        dbuf_mark(x, y);
+    }
 }
 
 static void
 dbuf_set_object(int x, int y, int oid, int omn)
 {
+    int obj;
+
     if (!isok(x, y))
         return;
 
-    dbuf[y][x].obj = obfuscate_object(oid);
-    dbuf[y][x].obj_mn = omn;
+    obj = obfuscate_object(oid);
+    if (dbuf[y][x].obj != obj || dbuf[y][x].obj_mn != omn) {
+        dbuf[y][x].obj = obj;
+        dbuf[y][x].obj_mn = omn;
+        dbuf_mark(x, y);
+    }
 }
 
 /*
@@ -1526,19 +1565,28 @@ void
 dbuf_set(int x, int y, int bg, int trap, int obj, int obj_mn, boolean invis,
          int mon, int monflags, int effect, int branding)
 {
+    struct nh_dbuf_entry entry;
+
     if (!isok(x, y))
         return;
 
-    dbuf[y][x].bg = bg;
-    dbuf[y][x].trap = trap;
-    dbuf[y][x].obj = obfuscate_object(obj);
-    dbuf[y][x].obj_mn = obj_mn;
-    dbuf[y][x].invis = invis;
-    dbuf[y][x].mon = mon;
-    dbuf[y][x].monflags = monflags;
-    dbuf[y][x].effect = effect;
-    dbuf[y][x].visible = cansee(x, y);
-    dbuf[y][x].branding = branding;
+    /* memset so that padding compares equal too */
+    memset(&entry, 0, sizeof (entry));
+    entry.bg = bg;
+    entry.trap = trap;
+    entry.obj = obfuscate_object(obj);
+    entry.obj_mn = obj_mn;
+    entry.invis = invis;
+    entry.mon = mon;
+    entry.monflags = monflags;
+    entry.effect = effect;
+    entry.visible = cansee(x, y);
+    entry.branding = branding;
+
+    if (memcmp(&dbuf[y][x], &entry, sizeof (entry))) {
+        memcpy(&dbuf[y][x], &entry, sizeof (entry));
+        dbuf_mark(x, y);
+    }
 }
 
 
@@ -1556,6 +1604,13 @@ void
 cls(void)
 {
     memset(dbuf, 0, sizeof (struct nh_dbuf_entry) * ROWNO * COLNO);
+
+    /* The window port may also have lost track of the screen, so send it all
+       of it next time. */
+    memset(dbuf_changed, 0xff, sizeof (dbuf_changed));
+    dbuf_lx = dbuf_ly = 0;
+    dbuf_hx = COLNO - 1;
+    dbuf_hy = ROWNO - 1;
 }
 
 
@@ -1573,6 +1628,42 @@ flush_screen_enable(void)
 }
 
 
+/*
+ * Send the display buffer to the window port: just the changed locations if it
+ * can take them, otherwise all of it.
+ */
+static void
+dbuf_send(int ux, int uy)
+{
+    int x, y, ncells = 0;
+
+    if (windowprocs.win_update_screen_delta) {
+        for (y = dbuf_ly; y <= dbuf_hy; y++)
+            for (x = dbuf_lx; x <= dbuf_hx; x++) {
+                if (!dbuf_changed[y][x >> 3]) {
+                    x |= 7;     /* skip the rest of this byte */
+                    continue;
+                }
+                if (dbuf_changed[y][x >> 3] & (1 << (x & 7))) {
+                    dbuf_delta[ncells].x = x;
+                    dbuf_delta[ncells].y = y;
+                    memcpy(&dbuf_delta[ncells].entry, &dbuf[y][x],
+                           sizeof (dbuf[y][x]));
+                    ncells++;
+                }
+            }
+        update_screen_delta(dbuf_delta, ncells, ux, uy);
+    } else
+        update_screen(dbuf, ux, uy);
+
+    for (y = dbuf_ly; y <= dbuf_hy; y++)
+        memset(dbuf_changed[y], 0, sizeof (dbuf_changed[y]));
+    dbuf_lx = COLNO;
+    dbuf_ly = ROWNO;
+    dbuf_hx = dbuf_hy = -1;
+}
+
+
 /*
  * Send the display buffer to the window port.
  */
@@ -1582,7 +1673,7 @@ flush_screen(void)
     if (turnstate.delay_flushing)
         return;
 
-    update_screen(dbuf, u.ux, u.uy);
+    dbuf_send(u.ux, u.uy);
 
     if (!program_state.panicking)
         bot();
@@ -1595,7 +1686,7 @@ flush_screen(void)
 void
 flush_screen_nopos(void)
 {
-    update_screen(dbuf, -1, -1);
+    dbuf_send(-1, -1);
 }
 
 /* ========================================================================= */
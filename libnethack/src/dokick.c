@@ -1520,6 +1520,8 @@ deliver_object(struct obj *obj, xchar dnum, xchar dlevel, int where)
         lev = mklev(&levnum);
         reset_rndmonst(NON_PM);
     }
+    /* lev is quite possibly not the current level */
+    discard_level_save_cache(ledger_no(&levnum));
 
     obj_extract_self(obj);
 
@@ -1199,6 +1199,7 @@ u_on_newpos(int x, int y)
 {
     if (!isok(u.ux, u.uy))
         panic("placing player outside the map boundaries");
+    mark_gamestate_changed();
     u.ux = x;
     u.uy = y;
     /* ridden steed always shares hero's location */
@@ -1087,13 +1087,22 @@ container_contents(struct obj *list, boolean identified, boolean all_containers)
 noreturn void
 terminate(enum nh_play_status playstatus)
 {
+    /* a background save verification process has nothing to unwind to */
+    if (program_state.verifying_save_in_background)
+        _exit(EXIT_FAILURE);
+
     /* don't bother to try to release memory if we're in panic mode, to avoid
        trouble in case that happens to be due to memory problems */
     if (!program_state.panicking) {
         freedynamicdata();
+        free_level_save_cache();
         dlb_cleanup();
     }
 
+    /* log_sync's decoding thread, if any, mustn't keep running past the
+       longjmp */
+    log_stop_pipeline();
+
     /* try to leave gracefully - this should return control to the ui code */
     if (exit_jmp_buf_valid) {
         exit_jmp_buf_valid = 0;
@@ -388,6 +388,7 @@ make_engr_at(struct level *lev, int x, int y, const char *s, long e_time,
 
     ep->nxt_engr = lev->lev_engr;
     lev->lev_engr = ep;
+    mark_level_changed(lev);
     ep->engr_x = x;
     ep->engr_y = y;
     ep->engr_txt = (char *)(ep + 1);
@@ -1335,6 +1336,7 @@ del_engr(struct engr *ep, struct level *lev)
         }
     }
     dealloc_engr(ep);
+    mark_level_changed(lev);
 }
 
 /* randomly relocate an engraving */
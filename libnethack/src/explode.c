@@ -388,7 +388,7 @@ explode(int x, int y, int type, /* the same as in zap.c */
 
         ugolemeffects((int)adtyp, damu);
         if (uhurt == 2) {
-            script_call("hp_loss_modifier", damu, &damu);
+            script_call_hook(HOOK_HP_LOSS_MODIFIER, damu, &damu);
             if (Upolyd)
                 u.mh -= damu;
             else
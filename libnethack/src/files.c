@@ -18,6 +18,7 @@
 
 #include <ctype.h>
 #include <fcntl.h>
+#include <signal.h>
 
 #include <errno.h>
 
@@ -26,7 +27,6 @@
 #if defined(WIN32)
 # include <sys/stat.h>
 #else
-# include <signal.h>
 # include <sys/select.h>
 # ifdef AIMAKE_BUILDOS_linux
 #  include <ucontext.h>
@@ -379,6 +379,17 @@ delete_bonesfile(char *bonesid)
  */
 
 
+/* Counts calls to change_fd_lock, including those from signal handlers. The
+   logfile can only shrink (via recovery) while we don't hold a lock on it, so
+   code that caches the length of the logfile (the mapped log reader in log.c)
+   must check it again whenever this has changed. */
+static volatile sig_atomic_t fd_lock_changes = 0;
+
+unsigned int
+get_fd_lock_changes(void)
+{
+    return fd_lock_changes;
+}
 #ifdef AIMAKE_BUILDOS_linux
 /*
  * We want to be notified about changes to the logfile; and we want to ensure
@@ -719,6 +730,8 @@ change_fd_lock(int fd, boolean on_logfile, enum locktype type, int timeout)
     if (fd == -1)
         return FALSE;
 
+    fd_lock_changes++;
+
     if (type == LT_MONITOR && !on_logfile)
         panic("Attempt to monitor lock something other than the logfile");
 
@@ -1002,6 +1015,8 @@ change_fd_lock(int fd, boolean on_logfile, enum locktype type, int timeout)
     if (fd == -1)
         return FALSE;
 
+    fd_lock_changes++;
+
     if (type == LT_MONITOR && !on_logfile)
         panic("Attempt to monitor lock something other than the logfile");
 
@@ -1047,6 +1062,8 @@ change_fd_lock(int fd, boolean on_logfile, enum locktype type, int timeout)
     if (fd == -1)
         return FALSE;
 
+    fd_lock_changes++;
+
     hFile = (HANDLE) _get_osfhandle(fd);
 
     UnlockFile(hFile, 0, 0, 64, 0); /* prevent issues with recursive locks */
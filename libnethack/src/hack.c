@@ -3105,7 +3105,7 @@ const double HP_LOSS_FACTOR = 0.5;
 void
 losehp(int n, const char *killer)
 {
-    script_call("hp_loss_modifier", n, &n);
+    script_call_hook(HOOK_HP_LOSS_MODIFIER, n, &n);
 
     if (Upolyd) {
         u.mh -= n;
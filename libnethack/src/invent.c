@@ -341,6 +341,7 @@ addinv(struct obj *obj)
 
     if (obj->where != OBJ_FREE)
         panic("addinv: obj not free");
+    mark_gamestate_changed();
 
     obj_was_thrown = obj->was_thrown;
 
@@ -557,6 +558,7 @@ freeinv(struct obj *obj)
         impossible("dropping item before unreadying it");
         uwepgone();
     }
+    mark_gamestate_changed();
     extract_nobj(obj, &invent, &turnstate.floating_objects, OBJ_FREE);
     freeinv_stats(obj);
     update_inventory();
@@ -24,11 +24,10 @@
  * The major working function is do_light_sources(). It is called when the
  * vision system is recreating its "could see" array.  Here we add a flag
  * (TEMP_LIT) to the array for all locations that are lit via a light source.
- * The bad part of this is that we have to re-calculate the LOS of each light
- * source every time the vision system runs.  Even if the light sources and any
- * topology (vision blocking positions) have not changed.  The good part is that
- * no extra memory is used, plus we don't have to figure out how far the sources
- * have moved, or if the topology has changed.
+ * Each light source remembers the area it lit last time, along with where it
+ * was, its range, and vision_clear_gen().  The LOS of a light source is only
+ * recalculated when one of those has changed, that is, when it has moved,
+ * changed range, or something has started or stopped blocking light.
  *
  * The structure of the save/restore mechanism is amazingly similar to the timer
  * save/restore.  This is because they both have the same principals of having
@@ -40,6 +39,7 @@
 #define LSF_NEEDS_FIXUP 0x2     /* need oid fixup */
 
 static void write_ls(struct memfile *mf, light_source *);
+static void light_area(light_source *);
 static int maybe_write_ls(struct memfile *mf, struct level *lev, int range,
                           boolean write_it);
 
@@ -64,7 +64,9 @@ new_light_source(struct level *lev, xchar x, xchar y, int range, int type,
     ls->type = type;
     ls->id = id;
     ls->flags = 0;
+    ls->lit_range = 0;
     lev->lev_lights = ls;
+    mark_level_changed(lev);
 
     turnstate.vision_full_recalc = TRUE;     /* make the source show up */
 }
@@ -106,6 +108,7 @@ del_light_source(struct level *lev, int type, void *id)
                 lev->lev_lights = curr->next;
 
             free(curr);
+            mark_level_changed(lev);
             turnstate.vision_full_recalc = TRUE;
             return;
         }
@@ -113,6 +116,48 @@ del_light_source(struct level *lev, int type, void *id)
     impossible("del_light_source: not found type=%d, id=%p", type, id);
 }
 
+/*
+ * Work out the area a light source lights from where it is now, and remember
+ * it.  This only depends on what blocks light, so clear_path() is given no
+ * vision array; the one location where that matters, the hero's, is handled
+ * by the caller.
+ *
+ * Kevin's tests indicated that doing this brute-force method is faster for
+ * radius <= 3 (or so).
+ */
+static void
+light_area(light_source *ls)
+{
+    int x, y, min_x, max_x, max_y, offset;
+    const char *limits;
+    uint32_t bits;
+
+    limits = circle_ptr(ls->range);
+    if ((max_y = (ls->y + ls->range)) >= ROWNO)
+        max_y = ROWNO - 1;
+    if ((y = (ls->y - ls->range)) < 0)
+        y = 0;
+    memset(ls->lit_rows, 0, sizeof (ls->lit_rows));
+    for (; y <= max_y; y++) {
+        offset = limits[abs(y - ls->y)];
+        if ((min_x = (ls->x - offset)) < 0)
+            min_x = 0;
+        if ((max_x = (ls->x + offset)) >= COLNO)
+            max_x = COLNO - 1;
+
+        bits = 0;
+        for (x = min_x; x <= max_x; x++)
+            if (clear_path((int)ls->x, (int)ls->y, x, y, NULL))
+                bits |= (uint32_t)1 << (x - ls->x + ls->range);
+        ls->lit_rows[y - ls->y + ls->range] = bits;
+    }
+
+    ls->lit_x = ls->x;
+    ls->lit_y = ls->y;
+    ls->lit_range = ls->range;
+    ls->lit_gen = vision_clear_gen();
+}
+
 /* Mark locations that are temporarily lit via mobile light sources. */
 void
 do_light_sources(char **cs_rows)
@@ -122,16 +167,12 @@ do_light_sources(char **cs_rows)
     short at_hero_range = 0;
     light_source *ls;
     char *row;
+    uint32_t bits;
 
     for (ls = level->lev_lights; ls; ls = ls->next) {
         ls->flags &= ~LSF_SHOW;
 
-        /* 
-         * Check for moved light sources.  It may be possible to
-         * save some effort if an object has not moved, but not in
-         * the current setup -- we need to recalculate for every
-         * vision recalc.
-         */
+        /* Check for moved light sources. */
         if (ls->type == LS_OBJECT) {
             if (get_obj_location((struct obj *)ls->id, &ls->x, &ls->y, 0))
                 ls->flags |= LSF_SHOW;
@@ -149,19 +190,21 @@ do_light_sources(char **cs_rows)
                 at_hero_range = ls->range;
         }
 
-        if (ls->flags & LSF_SHOW) {
+        if (!(ls->flags & LSF_SHOW))
+            continue;
+
+        limits = circle_ptr(ls->range);
+        if ((max_y = (ls->y + ls->range)) >= ROWNO)
+            max_y = ROWNO - 1;
+        if ((y = (ls->y - ls->range)) < 0)
+            y = 0;
+
+        if (ls->x == u.ux && ls->y == u.uy) {
             /* 
-             * Walk the points in the circle and see if they are
-             * visible from the center.  If so, mark'em.
-             *
-             * Kevin's tests indicated that doing this brute-force
-             * method is faster for radius <= 3 (or so).
+             * A light source carried by the hero lights whatever the hero
+             * could see, which is a lookup in cs_rows rather than a path to
+             * draw, so there's nothing to remember.
              */
-            limits = circle_ptr(ls->range);
-            if ((max_y = (ls->y + ls->range)) >= ROWNO)
-                max_y = ROWNO - 1;
-            if ((y = (ls->y - ls->range)) < 0)
-                y = 0;
             for (; y <= max_y; y++) {
                 row = cs_rows[y];
                 offset = limits[abs(y - ls->y)];
@@ -174,6 +217,29 @@ do_light_sources(char **cs_rows)
                     if (clear_path((int)ls->x, (int)ls->y, x, y, cs_rows))
                         row[x] |= TEMP_LIT;
             }
+            continue;
+        }
+
+        if (ls->lit_range != ls->range || ls->lit_x != ls->x ||
+            ls->lit_y != ls->y || ls->lit_gen != vision_clear_gen())
+            light_area(ls);
+
+        for (; y <= max_y; y++) {
+            row = cs_rows[y];
+            bits = ls->lit_rows[y - ls->y + ls->range];
+            if (y == u.uy && abs(u.ux - ls->x) <= ls->range)
+                bits &= ~((uint32_t)1 << (u.ux - ls->x + ls->range));
+            for (x = ls->x - ls->range; bits; x++, bits >>= 1)
+                if (bits & 1)
+                    row[x] |= TEMP_LIT;
+        }
+
+        /* clear_path() to the hero's location goes by what the hero could
+           see, rather than the path light_area() found */
+        y = abs(u.uy - ls->y);
+        if (y <= ls->range && abs(u.ux - ls->x) <= limits[y]) {
+            if (cs_rows[ls->y][ls->x] & COULD_SEE)
+                cs_rows[u.uy][u.ux] |= TEMP_LIT;
         }
     }
 }
@@ -307,6 +373,7 @@ restore_light_sources(struct memfile *mf, struct level *lev)
         ls->id = (void *)id;
         ls->x = mread8(mf);
         ls->y = mread8(mf);
+        ls->lit_range = 0;
 
         ls->next = rest;
         if (prev)
@@ -14,6 +14,15 @@
 #include <limits.h>
 #include <errno.h>
 #include <time.h>
+#ifndef AIMAKE_BUILDOS_MSWin32
+# include <sys/types.h>
+# include <sys/wait.h>
+# include <sys/mman.h>
+# include <sys/stat.h>
+# include <pthread.h>
+# include <signal.h>
+# include <unistd.h>
+#endif
 
 /* #define DEBUG */
 
@@ -29,7 +38,10 @@ static enum nh_log_status read_log_header(
     int fd, struct nh_game_info *si, int *recovery_count, boolean do_locking);
 
 static void load_gamestate_from_binary_save(boolean maybe_old_version);
+static void use_binary_save_as_gamestate(void);
 static void log_replay_save_line(void);
+static void log_index_add(long offset, long end, long prev, boolean backup);
+static void log_index_discard_file(void);
 
 static boolean full_read(int fd, void *buffer, int len);
 static boolean full_write(int fd, const void *buffer, int len);
@@ -180,6 +192,11 @@ log_recover_core(long offset, boolean canreturn, const char *message,
     struct nh_menulist menu;
     boolean ok = TRUE;
 
+    /* A process that was forked to verify a save mustn't touch the log or the
+       interface; the parent will notice that it failed and recover itself. */
+    if (program_state.verifying_save_in_background)
+        _exit(EXIT_FAILURE);
+
     program_state.emergency_recover_location = 0;
 
     if (program_state.followmode != FM_PLAY && message) {
@@ -326,6 +343,7 @@ log_recover_core(long offset, boolean canreturn, const char *message,
             raw_printf("Could not truncate save file during recovery!\n");
             terminate(ERR_RESTORE_FAILED);
         }
+        log_index_discard_file();
 
         /* Relinquish the lock, and reload the file. */
         if (!change_fd_lock(program_state.logfile, TRUE, LT_MONITOR, 1)) {
@@ -457,6 +475,60 @@ log_desync(char found, char expected)
                          __FILE__, __LINE__);
 }
 
+/***** Phase timing *****/
+
+/* Benchmarks can ask to be told how long each phase of save handling takes.
+   When they do, the pipeline thread isn't used, so that all the phases are
+   timed one at a time on the main thread.
+
+   Replaying doesn't write save diffs, so to time diff encoding, each gamestate
+   that's loaded while timing is re-saved relative to the one loaded before it
+   (timing_diff_base), as it would have been when the game was played. */
+static void (*save_timing_callback)(enum nh_save_phase, long long, long);
+static struct memfile timing_diff_base;
+static boolean timing_diff_base_allocated = FALSE;
+
+static void
+free_timing_diff_base(void)
+{
+    if (timing_diff_base_allocated)
+        mfree(&timing_diff_base);
+    timing_diff_base_allocated = FALSE;
+}
+
+void
+nh_set_save_timing_callback(
+    void (*callback)(enum nh_save_phase phase, long long nanoseconds,
+                     long bytes))
+{
+    save_timing_callback = callback;
+    if (!callback)
+        free_timing_diff_base();
+}
+
+/* Returns a timestamp in nanoseconds to give to save_timing_end, or 0 if
+   nothing's being timed. */
+static long long
+save_timing_start(void)
+{
+    if (!save_timing_callback)
+        return 0;
+#ifdef AIMAKE_BUILDOS_MSWin32
+    return (long long)clock() * (1000000000LL / CLOCKS_PER_SEC);
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+#endif
+}
+
+static void
+save_timing_end(enum nh_save_phase phase, long long start, long bytes)
+{
+    if (save_timing_callback && start)
+        save_timing_callback(phase, save_timing_start() - start, bytes);
+}
+
 /***** Base 64 handling *****/
 
 static const unsigned char b64e[64] =
@@ -487,10 +559,14 @@ base64_encode_binary(const unsigned char *in, char *out, int len)
     unsigned long olen = compressBound(len);
     unsigned char *o = malloc(olen);
 
+    long long t = save_timing_start();
+
     if (compress2(o, &olen, in, len, Z_BEST_COMPRESSION) != Z_OK) {
         panic("Could not compress input data!");
     }
     MARK_INITIALIZED(o, olen);
+    save_timing_end(SAVEPHASE_ZLIB, t, len);
+    t = save_timing_start();
 
     pos = sprintf(out, "$%d$", len);
 
@@ -522,6 +598,7 @@ base64_encode_binary(const unsigned char *in, char *out, int len)
     free(o);
 
     out[pos] = '\0';
+    save_timing_end(SAVEPHASE_BASE64, t, pos);
 }
 
 
@@ -541,13 +618,22 @@ base64_strlen(const char *in)
     return atoi(in + 1);
 }
 
-/* TODO: This should be communicating the end position of the base 64 data. */
-static void
-base64_decode(const char *in, char *out, int outlen)
+/* Decodes base 64 data (decompressing it if necessary), without reporting
+   errors, so that it can be used from the pipeline thread. Returns NULL on
+   success, or a message describing the error (which may contain %ld for the
+   log offset); zlib errors are also returned in *zerr.
+
+   TODO: This should be communicating the end position of the base 64 data. */
+static const char *
+base64_decode_inner(const char *in, char *out, int outlen, int *zerr)
 {
     int i, len = strlen(in), pos = 0, olen;
     char *o = out;
 
+    *zerr = Z_OK;
+
+    long long t = save_timing_start();
+
     olen = outlen;
     if (*in == '$') {
         o = malloc(len);
@@ -582,31 +668,54 @@ base64_decode(const char *in, char *out, int outlen)
 
     if (pos < olen)
         o[pos] = 0;
-    else
-        error_reading_save("Uncompressed base64 data was too long at %ld\n");
+    else {
+        if (*in == '$')
+            free(o);
+        return "Uncompressed base64 data was too long at %ld\n";
+    }
+    save_timing_end(SAVEPHASE_BASE64, t, len);
 
     if (*in == '$') {
 
         unsigned long blen = base64_strlen(in);
         if (blen > outlen) {
             free(o);
-            error_reading_save("Compressed base64 data was too long at %ld\n");
+            return "Compressed base64 data was too long at %ld\n";
         }
-        int errcode = uncompress((unsigned char *)out, &blen,
-                                 (unsigned char *)o, pos);
+        t = save_timing_start();
+        *zerr = uncompress((unsigned char *)out, &blen,
+                           (unsigned char *)o, pos);
+        save_timing_end(SAVEPHASE_ZLIB, t, blen);
 
         free(o);
-        if (errcode != Z_OK) {
-            raw_printf("Decompressing save file failed at %ld: %s\n",
-                       get_log_offset(),
-                       errcode == Z_MEM_ERROR ? "Out of memory" : errcode ==
-                       Z_BUF_ERROR ? "Invalid size" : errcode ==
-                       Z_DATA_ERROR ? "Corrupted file" : "(unknown error)");
-            error_reading_save("");
-        }
+        if (*zerr != Z_OK)
+            return "Decompressing save file failed";
 
         MARK_INITIALIZED(out, blen);
     }
+
+    return NULL;
+}
+
+static void
+base64_decode(const char *in, char *out, int outlen)
+{
+    int errcode;
+    const char *error = base64_decode_inner(in, out, outlen, &errcode);
+
+    if (!error)
+        return;
+
+    if (errcode != Z_OK) {
+        raw_printf("Decompressing save file failed at %ld: %s\n",
+                   get_log_offset(),
+                   errcode == Z_MEM_ERROR ? "Out of memory" : errcode ==
+                   Z_BUF_ERROR ? "Invalid size" : errcode ==
+                   Z_DATA_ERROR ? "Corrupted file" : "(unknown error)");
+        error_reading_save("");
+    }
+
+    error_reading_save(error);
 }
 
 /***** Log I/O *****/
@@ -709,6 +818,143 @@ log_binary(const char *buf, int buflen)
     free(b64buf);
 }
 
+/* Most reading of the log is done via a read-only mapping of it, so that lines
+   can be found (and skipped) without system calls or allocations. The log only
+   ever grows, except for recovery, which can't happen while we hold a lock on
+   it; so the mapping's length is checked again whenever it doesn't contain
+   what we're looking for, or we might have let go of the lock since the last
+   check. Anything the mapping can't answer falls back to reading the file. */
+#ifndef AIMAKE_BUILDOS_MSWin32
+
+static const char *logmap = NULL;
+static long logmap_len = 0;
+static int logmap_fd = -1;
+static unsigned int logmap_lock_changes;
+
+static void
+logmap_unmap(void)
+{
+    if (logmap)
+        munmap((void *)logmap, logmap_len);
+    logmap = NULL;
+    logmap_len = 0;
+    logmap_fd = -1;
+}
+
+/* Remaps the log if its length has changed. Returns the length that can be
+   read via the mapping. */
+static long
+logmap_refresh(void)
+{
+    struct stat st;
+    void *m;
+
+    logmap_lock_changes = get_fd_lock_changes();
+
+    if (logmap_fd != program_state.logfile)
+        logmap_unmap();
+
+    if (fstat(program_state.logfile, &st) < 0) {
+        logmap_unmap();
+        return 0;
+    }
+
+    if (logmap && st.st_size == logmap_len)
+        return logmap_len;
+
+    logmap_unmap();
+    if (st.st_size == 0)
+        return 0;
+
+    m = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, program_state.logfile, 0);
+    if (m == MAP_FAILED)
+        return 0;
+
+    logmap = m;
+    logmap_len = st.st_size;
+    logmap_fd = program_state.logfile;
+    return logmap_len;
+}
+
+/* Finds the line starting at the current file pointer in the log, returning a
+   pointer to it in the mapping (valid until the next log access), and its
+   length (excluding the newline) in *len. The file pointer is moved past the
+   newline. Returns NULL without moving the file pointer if the line can't be
+   found in the mapping (e.g. at EOF); in that case, the caller should fall back
+   to lgetline_malloc, which knows how to handle the situation. */
+static const char *
+lgetline_view(long *len)
+{
+    long pos = get_log_offset();
+    long maplen = logmap_len;
+    const char *nl = NULL;
+
+    if (logmap_fd != program_state.logfile ||
+        logmap_lock_changes != get_fd_lock_changes())
+        maplen = logmap_refresh();
+
+    if (pos < 0)
+        return NULL;
+
+    if (pos < maplen)
+        nl = memchr(logmap + pos, '\x0a', maplen - pos);
+
+    if (!nl) {
+        /* Perhaps the log has grown since we last looked. */
+        maplen = logmap_refresh();
+        if (pos >= maplen)
+            return NULL;
+        nl = memchr(logmap + pos, '\x0a', maplen - pos);
+        if (!nl)
+            return NULL;
+    }
+
+    *len = nl - (logmap + pos);
+    lseek(program_state.logfile, pos + *len + 1, SEEK_SET);
+    return logmap + pos;
+}
+
+#else
+
+/* No mmap on Windows; everything goes via read(). */
+static void
+logmap_unmap(void)
+{
+}
+
+static const char *
+lgetline_view(long *len)
+{
+    (void) len;
+    return NULL;
+}
+
+#endif
+
+/* Returns a malloc'd, NUL-terminated copy of a line found by lgetline_view. */
+static char *
+lview_strdup(const char *view, long len)
+{
+    char *rv = malloc(len + 1);
+
+    if (!rv)
+        panic("Out of memory in lview_strdup");
+    memcpy(rv, view, len);
+    rv[len] = '\0';
+    return rv;
+}
+
+/* Moves the file pointer past the line it's on, as free(lgetline_malloc())
+   would, but without copying the line if possible. */
+static void
+lskipline(void)
+{
+    long len;
+
+    if (!lgetline_view(&len))
+        free(lgetline_malloc(program_state.logfile));
+}
+
 /* Reads a line starting from the current file pointer. Returns NULL if the line
    is incomplete or spos is past EOF, otherwise mallocs enough space for the
    line and returns it. The file pointer is left at the newline, or in an
@@ -721,11 +967,16 @@ lgetline_malloc(int fd)
     long fpos = 0;      /* file pointer, relative to its original location */
     void *nlloc = NULL;
     boolean at_eof = FALSE;
+    const char *view;
+    long viewlen;
+
+    if (fd == program_state.logfile && (view = lgetline_view(&viewlen)))
+        return lview_strdup(view, viewlen);
 
     do {
-        inbuflen += 4;
-        inbuflen *= 3;
-        inbuflen /= 2;
+        /* Start big enough for any of the header lines in one read, so that
+           nh_get_savegame_status is cheap. */
+        inbuflen = inbuflen ? (inbuflen + 4) * 3 / 2 : 128;
         inbuf = realloc(inbuf, inbuflen);
         if (!inbuf)
             panic("Out of memory in lgetline_malloc");
@@ -831,6 +1082,27 @@ get_log_last_newline(int nth)
     if (!change_fd_lock(program_state.logfile, TRUE, LT_READ, 2))
         panic("Could not upgrade to read lock on logfile");
 
+#ifndef AIMAKE_BUILDOS_MSWin32
+    /* If we can, look through the mapping of the log instead. */
+    {
+        long maplen = logmap_refresh();
+
+        for (rv = maplen - 1; rv >= 0; rv--)
+            if (logmap[rv] == '\x0a' && !--nth)
+                break;
+
+        if (rv >= 0) {
+            if (!change_fd_lock(program_state.logfile, TRUE, LT_MONITOR, 2))
+                panic("Could not downgrade to monitor lock on logfile");
+
+            return rv + 1;
+        }
+
+        if (maplen)
+            error_reading_save("save file header is incomplete");
+    }
+#endif
+
     lseek(program_state.logfile, -1, SEEK_END);
 
     /* Run through the file backwards, reading one char at a time until we find
@@ -1104,12 +1376,19 @@ log_backup_save(void)
         return;
     }
 
+    long prev = program_state.binary_save_location;
     program_state.binary_save_location = 0;
-    if (program_state.binary_save_allocated)
+    long hint = 0;
+    if (program_state.binary_save_allocated) {
+        hint = program_state.binary_save.pos;
         mfree(&program_state.binary_save);
+    }
     mnew(&program_state.binary_save, NULL);
+    mhint_length(&program_state.binary_save, hint);
     program_state.binary_save_allocated = TRUE;
+    long long t = save_timing_start();
     savegame(&program_state.binary_save);
+    save_timing_end(SAVEPHASE_SAVEGAME, t, program_state.binary_save.pos);
 
     long o = get_log_offset();
     boolean is_newgame = program_state.save_backup_location == 0;
@@ -1118,6 +1397,7 @@ log_backup_save(void)
     program_state.binary_save_location = o;
     log_binary(program_state.binary_save.buf, program_state.binary_save.pos);
     lprintf("\x0a");
+    log_index_add(o, get_log_offset(), is_newgame ? -1 : prev, TRUE);
 
     /* Once per backup save is about the right rate to refresh this. */
     log_game_state_inner();
@@ -1142,6 +1422,173 @@ diff_error_at_neutral_turnstate(const char *message, char *diff)
     panic("Corrupted diff added to save file: %s", message);
 }
 
+/* Save verification policy.
+
+   Loading each new save back in and saving it again is the most expensive part
+   of a turn (three serializations and a deserialization in total), and catches
+   only bugs in the save code. Server operators can thus opt to do it less
+   often. Save backups are always verified regardless, because recovery relies
+   on them. Note that skipping a verification also means that play continues
+   from the in-memory gamestate rather than the reloaded one. */
+static enum nh_save_verification save_verification = SAVEVERIFY_ALWAYS;
+static int save_verification_interval = 50;
+static unsigned int last_verified_moves;
+static xchar last_verified_ledger;
+
+#ifndef AIMAKE_BUILDOS_MSWin32
+/* The background verification process, if any, and the offset in the log just
+   after the line it's verifying (i.e. where to recover to if it fails). */
+static pid_t verify_pid = 0;
+static long verify_line_location, verify_recover_location;
+#endif
+
+enum verify_action {
+    VERIFY_NOW,
+    VERIFY_IN_BACKGROUND,
+    VERIFY_SKIP
+};
+
+void
+nh_set_save_verification(enum nh_save_verification policy, int interval)
+{
+    save_verification = policy;
+    if (interval > 0)
+        save_verification_interval = interval;
+}
+
+/* Whether the shortcuts taken when saving (which aren't checked by verification,
+   because they'd give the same wrong answer when verifying) should also be
+   checked against doing things the slow way. */
+boolean
+log_paranoid_saves(void)
+{
+    return save_verification == SAVEVERIFY_PARANOID;
+}
+
+/* The binary save that the gamestate was last known to match, and the value of
+   gamestate_change_count() at the time; binary_save_match_location is -1 if
+   there's no such save. */
+static long binary_save_match_location = -1;
+static unsigned long binary_save_match_changes;
+
+static void
+note_gamestate_matches_binary_save(void)
+{
+    binary_save_match_location = program_state.binary_save_location;
+    binary_save_match_changes = gamestate_change_count();
+}
+
+static void
+note_save_verified(void)
+{
+    last_verified_moves = moves;
+    last_verified_ledger = ledger_no(&u.uz);
+}
+
+static enum verify_action
+save_verification_action(void)
+{
+    switch (save_verification) {
+    case SAVEVERIFY_PERIODIC:
+        if (moves >= last_verified_moves + save_verification_interval ||
+            moves < last_verified_moves ||
+            ledger_no(&u.uz) != last_verified_ledger)
+            return VERIFY_NOW;
+        return VERIFY_SKIP;
+    case SAVEVERIFY_ASYNC:
+#ifndef AIMAKE_BUILDOS_MSWin32
+        /* Only one check at a time; saves made while one's running aren't
+           checked, but the next one will be. */
+        return verify_pid ? VERIFY_SKIP : VERIFY_IN_BACKGROUND;
+#endif
+        /* no fork() on Windows, so fall through */
+    case SAVEVERIFY_ALWAYS:
+    case SAVEVERIFY_PARANOID:
+    default:
+        return VERIFY_NOW;
+    }
+}
+
+/* Checks on a background save verification. If it failed, recovers to just
+   after the line it was checking (as load_gamestate_from_binary_save would have
+   done had the check been run immediately). If wait is set, blocks until the
+   check is complete, and only logs a failure; this is for use when the game is
+   being closed. */
+static void
+reap_save_verification(boolean wait)
+{
+#ifndef AIMAKE_BUILDOS_MSWin32
+    int status;
+    pid_t rv;
+
+    if (!verify_pid)
+        return;
+
+    do
+        rv = waitpid(verify_pid, &status, wait ? 0 : WNOHANG);
+    while (rv == -1 && errno == EINTR);
+
+    if (rv == 0)
+        return; /* still running */
+
+    verify_pid = 0;
+
+    /* If the process went missing, we don't know anything about the save.
+       Otherwise, anything but a successful exit (including being killed by a
+       signal partway through the check) means it isn't known to be good. */
+    if (rv == -1 ||
+        (WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS))
+        return;
+
+    if (wait) {
+        paniclog("save verification", "background save verification failed");
+        return;
+    }
+
+    /* The binary save has been built on top of the broken line since, so go
+       back to the save before it, as load_gamestate_from_binary_save does. */
+    log_sync(verify_line_location - 1, TLU_BYTES, TRUE);
+    log_recover_noreturn(verify_recover_location,
+                         "Save file failed background verification",
+                         __FILE__, __LINE__);
+#else
+    (void) wait;
+#endif
+}
+
+#ifndef AIMAKE_BUILDOS_MSWin32
+/* Runs in a forked copy of the process, which therefore has its own snapshot of
+   the gamestate; checks that the diff just written reconstructs the new save
+   from oldsave, then does what load_gamestate_from_binary_save does. Reports
+   the result via the exit status. */
+static noreturn void
+verify_save_in_background(struct memfile *oldsave)
+{
+    struct memfile checkmf;
+
+    program_state.verifying_save_in_background = TRUE;
+
+    mnew(&checkmf, NULL);
+    mdiffapply(program_state.binary_save.diffbuf,
+               program_state.binary_save.diffpos, oldsave,
+               &checkmf, diff_error_at_neutral_turnstate);
+    if (!mequal(&checkmf, &program_state.binary_save, NULL))
+        _exit(EXIT_FAILURE);
+    mfree(&checkmf);
+    program_state.binary_save.relativeto = NULL;
+
+    freedynamicdata();
+    init_data(FALSE);
+    startup_common(FALSE);
+    dorecover(&program_state.binary_save);
+
+    mnew(&checkmf, NULL);
+    savegame(&checkmf);
+    _exit(mequal(&program_state.binary_save, &checkmf, NULL) ?
+          EXIT_SUCCESS : EXIT_FAILURE);
+}
+#endif
+
 void
 log_neutral_turnstate(void)
 {
@@ -1153,6 +1600,8 @@ log_neutral_turnstate(void)
         return;
     }
 
+    reap_save_verification(FALSE);
+
     /* A heuristic to work out whether to use a save diff or save backup
        line. */
     if (program_state.binary_save.pos <
@@ -1165,6 +1614,7 @@ log_neutral_turnstate(void)
 
         /* We're generating a save diff line. */
         struct memfile mf = program_state.binary_save;
+        enum verify_action verify = save_verification_action();
 
         /* start_updating_logfile can cause a turn restart, so place it
            outside the allocation of the new binary save */
@@ -1181,27 +1631,55 @@ log_neutral_turnstate(void)
 
         /* Save the game, and calculate a diff against the old location in
            the process. */
+        long long t = save_timing_start();
         savegame(&program_state.binary_save);
+        save_timing_end(SAVEPHASE_SAVEGAME, t, program_state.binary_save.pos);
 
         program_state.binary_save_location = get_log_offset();
 
+        t = save_timing_start();
         mdiffflush(&program_state.binary_save, 1);
+        save_timing_end(SAVEPHASE_DIFF, t, program_state.binary_save.diffpos);
 
         lprintf("~");
         log_binary(program_state.binary_save.diffbuf,
                    program_state.binary_save.diffpos);
         lprintf("\x0a");
+        log_index_add(program_state.binary_save_location, get_log_offset(),
+                      program_state.emergency_recover_location, FALSE);
+
+#ifndef AIMAKE_BUILDOS_MSWin32
+        if (verify == VERIFY_IN_BACKGROUND) {
+            pid_t pid;
+
+            verify_line_location = program_state.binary_save_location;
+            verify_recover_location = get_log_offset();
+            pid = fork();
+            if (pid == 0)
+                verify_save_in_background(&mf);
+            else if (pid > 0)
+                verify_pid = pid;
+            else
+                verify = VERIFY_NOW;    /* couldn't fork, so check it here */
+        }
+#endif
 
         /* Verify that the diffing algorithm is working correctly; we don't
            want to corrupt the save in a way that can't be recovered. */
-        {
+        if (verify == VERIFY_NOW) {
             struct memfile checkmf;
             mnew(&checkmf, NULL);
+            mhint_length(&checkmf, program_state.binary_save.pos);
+            t = save_timing_start();
             mdiffapply(program_state.binary_save.diffbuf,
                        program_state.binary_save.diffpos, &mf,
                        &checkmf, diff_error_at_neutral_turnstate);
+            save_timing_end(SAVEPHASE_DIFFAPPLY, t,
+                            program_state.binary_save.diffpos);
+            t = save_timing_start();
             if (!mequal(&checkmf, &program_state.binary_save, NULL))
                 panic("Corrupted diff added to save file");
+            save_timing_end(SAVEPHASE_MEQUAL, t, checkmf.pos);
             mfree(&checkmf);
         }
 
@@ -1213,7 +1691,10 @@ log_neutral_turnstate(void)
         stop_updating_logfile(1);
 
         /* Check the gamestate, for the same reason as in log_backup_save(). */
-        load_gamestate_from_binary_save(FALSE);
+        if (verify == VERIFY_NOW)
+            load_gamestate_from_binary_save(FALSE);
+        else
+            use_binary_save_as_gamestate();
 
         program_state.emergency_recover_location = 0;
     }
@@ -1278,7 +1759,19 @@ log_revert_command(const char *cmd)
     if (program_state.followmode != FM_PLAY)
         return;
 
+    /* If nothing has changed since the gamestate matched the binary save,
+       there's no need to compare them. In paranoid mode, compare anyway, in
+       case something changed without bumping the count. */
+    if (!log_paranoid_saves() &&
+        binary_save_match_location == program_state.binary_save_location &&
+        binary_save_match_changes == gamestate_change_count())
+        return;
+
+    /* Levels other than the current one come from the level save cache, so
+       this mostly costs a serialization of the current level and the rest of
+       the gamestate. */
     mnew(&mf, NULL);
+    mhint_length(&mf, program_state.binary_save.pos);
     savegame(&mf);
 
     if (!mequal(&program_state.binary_save, &mf, &mequal_reason)) {
@@ -1957,25 +2450,45 @@ load_gamestate_from_binary_save(boolean maybe_old_version)
 {
     struct memfile mf;
     const char *mequal_message;
+    boolean equal;
+    long long t;
 
     /* Load the saved game. */
+    binary_save_match_location = -1;
     program_state.gamestate_location = program_state.binary_save_location;
     lseek(program_state.logfile, program_state.binary_save_location,
           SEEK_SET);
-    free(lgetline_malloc(program_state.logfile));
+    lskipline();
     program_state.end_of_gamestate_location = get_log_offset();
 
     freedynamicdata();
     init_data(FALSE);
     startup_common(FALSE);
+    t = save_timing_start();
     dorecover(&program_state.binary_save);
+    save_timing_end(SAVEPHASE_DORECOVER, t, program_state.binary_save.pos);
 
     /* Save the loaded game. */
-    mnew(&mf, NULL);
+    mnew(&mf, save_timing_callback && timing_diff_base_allocated ?
+         &timing_diff_base : NULL);
+    mhint_length(&mf, program_state.binary_save.pos);
+    t = save_timing_start();
     savegame(&mf);
+    save_timing_end(SAVEPHASE_SAVEGAME, t, mf.pos);
 
-    if (!mequal(&program_state.binary_save, &mf, maybe_old_version ? NULL :
-                &mequal_message)) {
+    if (mf.relativeto) {
+        t = save_timing_start();
+        mdiffflush(&mf, 1);
+        save_timing_end(SAVEPHASE_DIFF, t, mf.diffpos);
+        mf.relativeto = NULL;
+    }
+
+    t = save_timing_start();
+    equal = mequal(&program_state.binary_save, &mf,
+                   maybe_old_version ? NULL : &mequal_message);
+    save_timing_end(SAVEPHASE_MEQUAL, t, mf.pos);
+
+    if (!equal) {
 
         mfree(&mf);
         if (maybe_old_version) {
@@ -1988,92 +2501,808 @@ load_gamestate_from_binary_save(boolean maybe_old_version)
         log_sync(program_state.binary_save_location - 1, TLU_BYTES, TRUE);
         lseek(program_state.logfile, program_state.binary_save_location,
               SEEK_SET);
-        free(lgetline_malloc(program_state.logfile));
+        lskipline();
         log_recover_noreturn(get_log_offset(), mequal_message,
                              __FILE__, __LINE__);
     }
 
+    if (save_timing_callback) {
+        free_timing_diff_base();
+        mclone(&timing_diff_base, &mf);
+        timing_diff_base_allocated = TRUE;
+    }
+
     /* Replace the old save file with the new save file. */
     mfree(&program_state.binary_save);
     program_state.binary_save = mf;
     program_state.ok_to_diff = TRUE;
+    note_save_verified();
+    note_gamestate_matches_binary_save();
 }
 
-static noreturn void
-apply_save_diff_error(const char *s, char *buf)
-{
-    free(buf);
-    mfree(&program_state.binary_save);
-    program_state.binary_save_allocated = FALSE;
-    error_reading_save(s);
-}
-
-/* Decodes the given save diff into program_state.binary_save. The caller should
-   check that the string actually is a representation of a save diff, is
-   responsible for fixing the invariants on program_state, and must move the
-   binary save out of the way for safekeeping first. */
+/* The counterpart of load_gamestate_from_binary_save for when the save isn't
+   being verified: the in-memory gamestate already matches the binary save, so
+   just record where in the log it is. */
 static void
-apply_save_diff(char *s, struct memfile *diff_base)
+use_binary_save_as_gamestate(void)
 {
-    char *buf;
-    long buflen;
+    program_state.gamestate_location = program_state.binary_save_location;
+    lseek(program_state.logfile, program_state.binary_save_location,
+          SEEK_SET);
+    lskipline();
+    program_state.end_of_gamestate_location = get_log_offset();
+    note_gamestate_matches_binary_save();
+}
 
-    if (program_state.binary_save_allocated)
-        panic("The caller of apply_save_diff must back up and deallocate "
-              "the binary save");
+/***** Seek index *****/
+
+/* log_sync needs to find the save lines either side of a target location. For
+   a long game, finding these by reading through the log is slow, because the
+   only way to learn the turn count of a save diff is to decode every save line
+   before it. So we remember the extent and turn count of each save line that we
+   decode or write, for as long as the log is loaded (the log is append-only
+   apart from recovery, which always causes a log_reset, so the index can't go
+   stale).
+
+   The index can't go in the log itself, because anything appended to the log
+   would be in the way of the next line written. If the interface gives us a
+   file to keep it in (nh_set_log_index_fd), each entry is also appended there
+   as a fixed-length text record, and the file is read back when the log is
+   next loaded, so that a cold load can start from the save backup nearest the
+   target. The log can be recovered or replaced without the index file being
+   told, so the file is checked against the log as it's loaded: the entries
+   must be consistent with each other and lie within the log, turn counts must
+   never decrease, and every save backup (and the last entry) must start with
+   the right marker and end at a newline. If anything is wrong, the file is
+   emptied and rebuilt as the log is read, as if there were none.
+
+   Entries are sorted by offset. Each also records the offset of the save line
+   immediately before it in the log, if known; this lets log_sync replay a run
+   of consecutive save lines without looking at the lines in between. */
+struct log_index_entry {
+    long offset;        /* start of the save line */
+    long end;           /* start of the line after it */
+    long prev;          /* start of the previous save line, or -1 */
+    long moves;         /* turn counter of the save */
+    boolean backup;     /* save backup, rather than save diff */
+};
 
-    mnew(&program_state.binary_save, NULL);
-    program_state.binary_save_allocated = TRUE;
+static struct log_index_entry *log_index = NULL;
+static int log_index_count = 0;
+static int log_index_size = 0;
 
-    /* The header of a save diff is one byte, '~'. */
-    s++;
+/* The index file: offset, end, previous save line (ffffffff if unknown) and
+   turn counter in hex, then b for a save backup or d for a save diff. */
+#define LOG_INDEX_RECORD_FORMAT "%08lx %08lx %08lx %08lx %c\n"
+#define LOG_INDEX_RECORD_LEN 38
+#define LOG_INDEX_NO_PREV 0xFFFFFFFFUL
 
-    buflen = base64_strlen(s);
-    buf = malloc(buflen + 2);
-    memset(buf, 0, buflen + 2);
-    base64_decode(s, buf, buflen);
+static int log_index_fd = -1;
 
-    mdiffapply(buf, buflen, diff_base, &program_state.binary_save,
-               apply_save_diff_error);
-    free(buf);
+/* Sets the file that the seek index of the next game's log is kept in, or -1
+   for none. It should be opened for reading and writing, and start out empty
+   if the log is new. The file isn't closed by libnethack; the caller can close
+   it once nh_play_game returns, after setting this back to -1. */
+void
+nh_set_log_index_fd(int fd)
+{
+    log_index_fd = fd;
 }
 
-/* Decodes the given string into program_state.binary_save. The caller should
-   check that the string actually is a representation of a save backup, and is
-   responsible for fixing the invariants on program_state. */
+/* Empties the index file, e.g. because the log has been truncated. */
 static void
-load_save_backup_from_string(char *s)
+log_index_discard_file(void)
 {
-    void *mp;
-    long len;
+    /* If it can't be emptied, it will fail its checks on the next load; just
+       stop adding to it. */
+    if (log_index_fd != -1 && ftruncate(log_index_fd, 0) < 0)
+        log_index_fd = -1;
+}
 
-    if (program_state.binary_save_allocated)
-        mfree(&program_state.binary_save);
-    mnew(&program_state.binary_save, NULL);
-    program_state.binary_save_allocated = TRUE;
+static void
+log_index_write(const struct log_index_entry *e)
+{
+    char buf[80];
 
-    /* The header is '*', an 8 digit hex number, and ' ', = 10 bytes. */
-    s += 10;
-    len = base64_strlen(s);
+    if (log_index_fd == -1)
+        return;
 
-    mp = mmmap(&program_state.binary_save, len, 0);
-    base64_decode(s, mp, len);
+    /* If an entry doesn't fit its record (which the log's own 8-digit offsets
+       should prevent), or a write fails (leaving the file the wrong length, so
+       that the next load discards it), stop adding to the file. */
+    if (snprintf(buf, sizeof buf, LOG_INDEX_RECORD_FORMAT,
+                 (unsigned long)e->offset, (unsigned long)e->end,
+                 e->prev < 0 ? LOG_INDEX_NO_PREV : (unsigned long)e->prev,
+                 (unsigned long)e->moves, e->backup ? 'b' : 'd') !=
+        LOG_INDEX_RECORD_LEN ||
+        lseek(log_index_fd, 0, SEEK_END) < 0 ||
+        !full_write(log_index_fd, buf, LOG_INDEX_RECORD_LEN))
+        log_index_fd = -1;
 }
 
-/* Sets the binary save and save backup locations from the argument (which
-   should be the byte offset of a save backup; the caller must check this), and
-   sets the binary save to match. This does /not/ enforce the invariant that
-   binary_save_location <= gamestate_location; the caller may need to fix
-   that. The log file pointer is left immediately after the save backup. */
 static void
-load_save_backup_from_offset(long offset)
+log_index_free(void)
 {
-    char *logline;
+    free(log_index);
+    log_index = NULL;
+    log_index_count = 0;
+    log_index_size = 0;
+}
 
-    program_state.binary_save_location = offset;
-    program_state.save_backup_location = offset;
+/* Returns the position of the first entry at or after offset, which may be
+   log_index_count. */
+static int
+log_index_lower_bound(long offset)
+{
+    int lo = 0, hi = log_index_count;
 
-    lseek(program_state.logfile, offset, SEEK_SET);
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+
+        if (log_index[mid].offset < offset)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/* Returns the entry for the save line at offset, or -1 if it isn't indexed. */
+static int
+log_index_find(long offset)
+{
+    int i = log_index_lower_bound(offset);
+
+    if (i < log_index_count && log_index[i].offset == offset)
+        return i;
+    return -1;
+}
+
+/* Adds an entry for a save line that isn't in the index yet. Returns its
+   position. */
+static int
+log_index_insert(long offset, long end, long prev, long moves,
+                 boolean backup)
+{
+    int i = log_index_lower_bound(offset);
+
+    if (log_index_count == log_index_size) {
+        log_index_size = log_index_size ? log_index_size * 2 : 256;
+        log_index = realloc(log_index, log_index_size * sizeof *log_index);
+        if (!log_index)
+            panic("Out of memory in log_index_insert");
+    }
+
+    memmove(log_index + i + 1, log_index + i,
+            (log_index_count - i) * sizeof *log_index);
+    log_index_count++;
+
+    log_index[i].offset = offset;
+    log_index[i].end = end;
+    log_index[i].prev = prev;
+    log_index[i].moves = moves;
+    log_index[i].backup = backup;
+    return i;
+}
+
+/* Records the save line that was just decoded into program_state.binary_save
+   (or written from it). prev is the offset of the save line before it, or -1
+   if unknown. */
+static void
+log_index_add(long offset, long end, long prev, boolean backup)
+{
+    long temp_pos = program_state.binary_save.pos;
+    long moves_here;
+    int i = log_index_find(offset);
+
+    if (i >= 0) {
+        if (log_index[i].prev < 0 && prev >= 0) {
+            log_index[i].prev = prev;
+            log_index_write(log_index + i);
+        }
+        return;
+    }
+
+    /* Saves from a different version can't be indexed (relative_to_target
+       will complain about them if it matters). */
+    program_state.binary_save.pos = 0;
+    if (!uptodate(&program_state.binary_save, NULL)) {
+        program_state.binary_save.pos = temp_pos;
+        return;
+    }
+    moves_here = mread32(&program_state.binary_save);
+    program_state.binary_save.pos = temp_pos;
+
+    i = log_index_insert(offset, end, prev, moves_here, backup);
+    log_index_write(log_index + i);
+}
+
+/* Returns TRUE if the log has a save line of the entry's type that starts and
+   ends where the entry says. Leaves the log file pointer in an
+   unpredictable location. */
+static boolean
+log_index_entry_matches_log(const struct log_index_entry *e)
+{
+    char c;
+
+    if (lseek(program_state.logfile, e->offset, SEEK_SET) < 0 ||
+        !full_read(program_state.logfile, &c, 1) ||
+        c != (e->backup ? '*' : '~'))
+        return FALSE;
+
+    if (lseek(program_state.logfile, e->end - 1, SEEK_SET) < 0 ||
+        !full_read(program_state.logfile, &c, 1) || c != '\x0a')
+        return FALSE;
+
+    return TRUE;
+}
+
+/* Loads the index file (if any) into the index, which must be empty. If the
+   file doesn't match the log, the index is left empty and the file is
+   emptied. The log file pointer is left where it was. */
+static void
+log_index_load(void)
+{
+    long oldoffset = get_log_offset();
+    long loglen, len, pos;
+    char *buf;
+    boolean ok = TRUE;
+    int i;
+
+    if (log_index_fd == -1)
+        return;
+
+    len = lseek(log_index_fd, 0, SEEK_END);
+    if (len <= 0)
+        return;
+    if (len % LOG_INDEX_RECORD_LEN || len > INT_MAX) {
+        log_index_discard_file();
+        return;
+    }
+
+    buf = malloc(len + 1);
+    if (!buf)
+        return;
+    if (lseek(log_index_fd, 0, SEEK_SET) < 0 ||
+        !full_read(log_index_fd, buf, len)) {
+        free(buf);
+        return;
+    }
+    buf[len] = '\0';
+
+    /* Parse the records. A save line can be recorded more than once (e.g.
+       again once its predecessor is known, or by several processes reading the
+       same log); later records can only fill in a missing prev. */
+    for (pos = 0; ok && pos < len; pos += LOG_INDEX_RECORD_LEN) {
+        unsigned long offset, end, prev, moves;
+        char type;
+
+        if (sscanf(buf + pos, "%8lx %8lx %8lx %8lx %c", &offset, &end, &prev,
+                   &moves, &type) != 5 ||
+            (type != 'b' && type != 'd') ||
+            buf[pos + LOG_INDEX_RECORD_LEN - 1] != '\x0a' ||
+            offset >= end || (prev != LOG_INDEX_NO_PREV && prev >= offset)) {
+            ok = FALSE;
+            break;
+        }
+
+        i = log_index_find(offset);
+        if (i < 0)
+            log_index_insert(offset, end, prev == LOG_INDEX_NO_PREV ? -1 :
+                             (long)prev, moves, type == 'b');
+        else if (log_index[i].end != (long)end ||
+                 log_index[i].moves != (long)moves ||
+                 log_index[i].backup != (type == 'b'))
+            ok = FALSE;
+        else if (log_index[i].prev < 0 && prev != LOG_INDEX_NO_PREV)
+            log_index[i].prev = prev;
+    }
+    free(buf);
+
+    /* Check the entries against each other and against the log. */
+    loglen = lseek(program_state.logfile, 0, SEEK_END);
+    for (i = 0; ok && i < log_index_count; i++) {
+        const struct log_index_entry *e = log_index + i;
+
+        if (e->end > loglen ||
+            (i > 0 && (e[-1].end > e->offset || e[-1].moves > e->moves)))
+            ok = FALSE;
+        else if ((e->backup || i == log_index_count - 1) &&
+                 !log_index_entry_matches_log(e))
+            ok = FALSE;
+    }
+
+    lseek(program_state.logfile, oldoffset, SEEK_SET);
+
+    if (!ok) {
+        log_index_free();
+        log_index_discard_file();
+    }
+}
+
+/***** Replay keyframes *****/
+
+/* Moving backwards in a replay means going back to a save backup and applying
+   every save diff from there to the target, which gets slow when stepping back
+   one command at a time. So while replaying, we keep copies of the decoded
+   binary save every few save lines, and log_sync can start from the nearest of
+   those instead. The copies are evicted least-recently-used first, to keep
+   within a memory budget set by the interface. */
+#define KEYFRAME_INTERVAL 16    /* save lines between keyframes */
+
+struct log_keyframe {
+    long offset;                /* location of the save line */
+    long backup;                /* location of its save backup */
+    long moves;                 /* turn counter of the save */
+    char *buf;
+    long len;
+    unsigned long last_used;
+};
+
+static struct log_keyframe *keyframes = NULL;
+static int keyframe_count = 0;
+static int keyframe_size = 0;
+static long keyframe_budget = 32L * 1024L * 1024L;
+static long keyframe_memory = 0;
+static int lines_since_keyframe = 0;
+static unsigned long keyframe_clock = 0;
+
+void
+nh_set_replay_cache_size(long kilobytes)
+{
+    if (kilobytes >= 0)
+        keyframe_budget = kilobytes * 1024L;
+}
+
+static void
+log_keyframe_evict(int k)
+{
+    keyframe_memory -= keyframes[k].len;
+    free(keyframes[k].buf);
+    keyframes[k] = keyframes[--keyframe_count];
+}
+
+static void
+log_keyframes_free(void)
+{
+    while (keyframe_count)
+        log_keyframe_evict(keyframe_count - 1);
+    free(keyframes);
+    keyframes = NULL;
+    keyframe_size = 0;
+    lines_since_keyframe = 0;
+}
+
+/* Called whenever a replay moves forwards onto a new save line, with the binary
+   save and its location already updated to match. */
+static void
+log_keyframe_note(boolean backup)
+{
+    long len = program_state.binary_save.pos;
+    int i, k;
+
+    if (program_state.followmode != FM_REPLAY)
+        return;
+
+    /* A save backup is just as cheap to load as a keyframe. */
+    if (backup) {
+        lines_since_keyframe = 0;
+        return;
+    }
+    if (++lines_since_keyframe < KEYFRAME_INTERVAL || len > keyframe_budget)
+        return;
+
+    i = log_index_find(program_state.binary_save_location);
+    if (i < 0)
+        return;
+    for (k = 0; k < keyframe_count; k++)
+        if (keyframes[k].offset == program_state.binary_save_location)
+            return;
+
+    lines_since_keyframe = 0;
+
+    while (keyframe_count && keyframe_memory + len > keyframe_budget) {
+        int lru = 0;
+
+        for (k = 1; k < keyframe_count; k++)
+            if (keyframes[k].last_used < keyframes[lru].last_used)
+                lru = k;
+        log_keyframe_evict(lru);
+    }
+
+    if (keyframe_count == keyframe_size) {
+        keyframe_size = keyframe_size ? keyframe_size * 2 : 64;
+        keyframes = realloc(keyframes, keyframe_size * sizeof *keyframes);
+        if (!keyframes)
+            panic("Out of memory in log_keyframe_note");
+    }
+
+    k = keyframe_count++;
+    keyframes[k].offset = program_state.binary_save_location;
+    keyframes[k].backup = program_state.save_backup_location;
+    keyframes[k].moves = log_index[i].moves;
+    keyframes[k].len = len;
+    keyframes[k].buf = malloc(len);
+    if (!keyframes[k].buf)
+        panic("Out of memory in log_keyframe_note");
+    memcpy(keyframes[k].buf, mmmap(&program_state.binary_save, len, 0), len);
+    keyframes[k].last_used = ++keyframe_clock;
+    keyframe_memory += len;
+}
+
+/* Replaces the binary save with a copy of the given keyframe. */
+static void
+log_keyframe_restore(int k)
+{
+    if (program_state.binary_save_allocated)
+        mfree(&program_state.binary_save);
+    mnew(&program_state.binary_save, NULL);
+    program_state.binary_save_allocated = TRUE;
+
+    memcpy(mmmap(&program_state.binary_save, keyframes[k].len, 0),
+           keyframes[k].buf, keyframes[k].len);
+
+    program_state.binary_save_location = keyframes[k].offset;
+    program_state.save_backup_location = keyframes[k].backup;
+    keyframes[k].last_used = ++keyframe_clock;
+}
+
+static noreturn void
+apply_save_diff_error(const char *s, char *buf)
+{
+    free(buf);
+    mfree(&program_state.binary_save);
+    program_state.binary_save_allocated = FALSE;
+    error_reading_save(s);
+}
+
+/* Applies a save diff that's already been decoded into buf (which this function
+   frees); see apply_save_diff. */
+static void
+apply_decoded_save_diff(char *buf, long buflen, struct memfile *diff_base)
+{
+    if (program_state.binary_save_allocated)
+        panic("The caller of apply_save_diff must back up and deallocate "
+              "the binary save");
+
+    mnew(&program_state.binary_save, NULL);
+    program_state.binary_save_allocated = TRUE;
+
+    long long t = save_timing_start();
+    mdiffapply(buf, buflen, diff_base, &program_state.binary_save,
+               apply_save_diff_error);
+    save_timing_end(SAVEPHASE_DIFFAPPLY, t, buflen);
+    free(buf);
+}
+
+/* Decodes the given save diff into program_state.binary_save. The caller should
+   check that the string actually is a representation of a save diff, is
+   responsible for fixing the invariants on program_state, and must move the
+   binary save out of the way for safekeeping first. */
+static void
+apply_save_diff(char *s, struct memfile *diff_base)
+{
+    char *buf;
+    long buflen;
+
+    /* The header of a save diff is one byte, '~'. */
+    s++;
+
+    buflen = base64_strlen(s);
+    buf = malloc(buflen + 2);
+    memset(buf, 0, buflen + 2);
+    base64_decode(s, buf, buflen);
+
+    apply_decoded_save_diff(buf, buflen, diff_base);
+}
+
+/* Decodes the given string into program_state.binary_save. The caller should
+   check that the string actually is a representation of a save backup, and is
+   responsible for fixing the invariants on program_state. */
+static void
+load_save_backup_from_string(char *s)
+{
+    void *mp;
+    long len;
+
+    if (program_state.binary_save_allocated)
+        mfree(&program_state.binary_save);
+    mnew(&program_state.binary_save, NULL);
+    program_state.binary_save_allocated = TRUE;
+
+    /* The header is '*', an 8 digit hex number, and ' ', = 10 bytes. */
+    s += 10;
+    len = base64_strlen(s);
+
+    mp = mmmap(&program_state.binary_save, len, 0);
+    base64_decode(s, mp, len);
+}
+
+/* As load_save_backup_from_string, but for a save backup that's already been
+   decoded into buf (which this function frees). */
+static void
+load_decoded_save_backup(char *buf, long len)
+{
+    if (program_state.binary_save_allocated)
+        mfree(&program_state.binary_save);
+    mnew(&program_state.binary_save, NULL);
+    program_state.binary_save_allocated = TRUE;
+
+    memcpy(mmmap(&program_state.binary_save, len, 0), buf, len);
+    free(buf);
+}
+
+/***** Decoding pipeline *****/
+
+/* When log_sync has a long way to go, most of its time goes on base 64 decoding
+   and decompressing save lines, which doesn't depend on the gamestate. So once
+   a sync has gone on for a while, we start a thread that reads ahead through
+   the log and decodes save lines, leaving the main thread just to apply them.
+
+   The thread never reports errors itself (it can't safely interact with the
+   rest of the program). If anything goes wrong, including reaching the end of
+   the log, it stops, and log_sync goes back to reading the log itself, which
+   reports any problem in the usual way. It reads with pread, so that the main
+   thread's file pointer is unaffected, and only runs while log_sync holds a
+   read lock on the log. */
+struct decoded_save_line {
+    long offset;        /* start of the save line */
+    long end;           /* start of the line after it */
+    long prev;          /* start of the save line before it */
+    boolean backup;     /* save backup, rather than save diff */
+    char *buf;          /* decoded contents; NULL if the thread stopped */
+    long len;
+};
+
+#ifndef AIMAKE_BUILDOS_MSWin32
+
+# define PIPELINE_THRESHOLD 8   /* save lines to sync before starting */
+# define PIPELINE_DEPTH 8       /* decoded save lines to buffer */
+
+static pthread_t pipeline_thread;
+static pthread_mutex_t pipeline_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pipeline_not_full = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t pipeline_not_empty = PTHREAD_COND_INITIALIZER;
+static boolean pipeline_running = FALSE;
+static boolean pipeline_cancel;
+static int pipeline_fd;
+static long pipeline_start_offset, pipeline_start_prev;
+static struct decoded_save_line pipeline_queue[PIPELINE_DEPTH];
+static int pipeline_head, pipeline_count;
+
+/* A window onto the log, for reading it a line at a time via pread. */
+struct pipeline_reader {
+    char *buf;
+    long base;          /* file offset of buf[0] */
+    long pos;           /* start of the next line, relative to buf */
+    long len;           /* bytes of buf that hold data */
+    long size;          /* bytes allocated for buf */
+};
+
+/* Returns the next line, with its newline replaced by a NUL; the pointer is
+   valid until the next call. Returns NULL on EOF, a partial line, or error. */
+static char *
+pipeline_getline(struct pipeline_reader *r)
+{
+    char *nl, *line;
+    ssize_t n;
+
+    while (r->pos == r->len ||
+           !(nl = memchr(r->buf + r->pos, '\x0a', r->len - r->pos))) {
+        if (r->pos) {
+            memmove(r->buf, r->buf + r->pos, r->len - r->pos);
+            r->base += r->pos;
+            r->len -= r->pos;
+            r->pos = 0;
+        }
+
+        if (r->size - r->len < 65536) {
+            r->size = r->size * 2 + 65536;
+            r->buf = realloc(r->buf, r->size);
+            if (!r->buf)
+                return NULL;
+        }
+
+        do
+            n = pread(pipeline_fd, r->buf + r->len, r->size - r->len,
+                      r->base + r->len);
+        while (n < 0 && errno == EINTR);
+
+        if (n <= 0)
+            return NULL;
+        r->len += n;
+    }
+
+    *nl = '\0';
+    line = r->buf + r->pos;
+    r->pos = nl + 1 - r->buf;
+    return line;
+}
+
+static void *
+pipeline_main(void *unused)
+{
+    struct pipeline_reader r = {.base = pipeline_start_offset};
+    long prev = pipeline_start_prev;
+    struct decoded_save_line d;
+    sigset_t sigset;
+
+    (void) unused;
+
+    /* Signals (in particular, the ones used for locking) are the main thread's
+       business. */
+    sigfillset(&sigset);
+    pthread_sigmask(SIG_BLOCK, &sigset, NULL);
+
+    do {
+        char *line;
+        long offset;
+
+        do {
+            offset = r.base + r.pos;
+            line = pipeline_getline(&r);
+        } while (line && *line != '*' && *line != '~');
+
+        d.buf = NULL;
+        if (line) {
+            int zerr;
+
+            /* Skip the headers: '~' for a diff, "*%08lx " for a backup. */
+            d.backup = *line == '*';
+            line += d.backup ? 10 : 1;
+
+            d.offset = offset;
+            d.end = r.base + r.pos;
+            d.prev = prev;
+            d.len = base64_strlen(line);
+            d.buf = malloc(d.len + 2);
+            if (d.buf) {
+                memset(d.buf, 0, d.len + 2);
+                if (base64_decode_inner(line, d.buf, d.len, &zerr)) {
+                    free(d.buf);
+                    d.buf = NULL;
+                }
+            }
+        }
+
+        pthread_mutex_lock(&pipeline_mutex);
+        while (pipeline_count == PIPELINE_DEPTH && !pipeline_cancel)
+            pthread_cond_wait(&pipeline_not_full, &pipeline_mutex);
+        if (pipeline_cancel) {
+            pthread_mutex_unlock(&pipeline_mutex);
+            free(d.buf);
+            break;
+        }
+        pipeline_queue[(pipeline_head + pipeline_count) % PIPELINE_DEPTH] = d;
+        pipeline_count++;
+        pthread_cond_signal(&pipeline_not_empty);
+        pthread_mutex_unlock(&pipeline_mutex);
+
+        prev = d.offset;
+    } while (d.buf);
+
+    free(r.buf);
+    return NULL;
+}
+
+/* Starts decoding save lines from offset onwards; prev is the location of the
+   save line that ends at offset. */
+static void
+pipeline_start(long offset, long prev)
+{
+    if (pipeline_running || save_timing_callback)
+        return;
+
+    pipeline_fd = program_state.logfile;
+    pipeline_start_offset = offset;
+    pipeline_start_prev = prev;
+    pipeline_cancel = FALSE;
+    pipeline_head = pipeline_count = 0;
+
+    /* If we can't start a thread, we just carry on without one. */
+    pipeline_running =
+        !pthread_create(&pipeline_thread, NULL, pipeline_main, NULL);
+}
+
+static void
+pipeline_stop(void)
+{
+    if (!pipeline_running)
+        return;
+
+    pthread_mutex_lock(&pipeline_mutex);
+    pipeline_cancel = TRUE;
+    pthread_cond_broadcast(&pipeline_not_full);
+    pthread_mutex_unlock(&pipeline_mutex);
+
+    pthread_join(pipeline_thread, NULL);
+    pipeline_running = FALSE;
+
+    while (pipeline_count) {
+        free(pipeline_queue[pipeline_head].buf);
+        pipeline_head = (pipeline_head + 1) % PIPELINE_DEPTH;
+        pipeline_count--;
+    }
+}
+
+/* Fetches the decoded save line that follows the one at sloc, if the pipeline
+   has it. Otherwise, stops the pipeline and returns FALSE; the caller must then
+   read the line itself. */
+static boolean
+pipeline_next(long sloc, struct decoded_save_line *d)
+{
+    if (!pipeline_running)
+        return FALSE;
+
+    pthread_mutex_lock(&pipeline_mutex);
+    while (pipeline_count == 0)
+        pthread_cond_wait(&pipeline_not_empty, &pipeline_mutex);
+    *d = pipeline_queue[pipeline_head];
+    pipeline_head = (pipeline_head + 1) % PIPELINE_DEPTH;
+    pipeline_count--;
+    pthread_cond_signal(&pipeline_not_full);
+    pthread_mutex_unlock(&pipeline_mutex);
+
+    if (d->buf && d->prev == sloc)
+        return TRUE;
+
+    free(d->buf);
+    d->buf = NULL;
+    pipeline_stop();
+    return FALSE;
+}
+
+#else
+
+/* No pthreads on Windows; log_sync just does everything itself. */
+# define PIPELINE_THRESHOLD -1
+
+static void
+pipeline_start(long offset, long prev)
+{
+    (void) offset;
+    (void) prev;
+}
+
+static void
+pipeline_stop(void)
+{
+}
+
+static boolean
+pipeline_next(long sloc, struct decoded_save_line *d)
+{
+    (void) sloc;
+    d->buf = NULL;
+    return FALSE;
+}
+
+#endif
+
+/* Stops the decoding pipeline, if it's running. log_sync stops it itself on
+   the way out, but an error partway through (error_reading_save, panic, and
+   so on) longjmps straight past that; terminate() calls this before doing so,
+   so that the thread doesn't outlive the sync it was decoding for. */
+void
+log_stop_pipeline(void)
+{
+    pipeline_stop();
+}
+
+/* Sets the binary save and save backup locations from the argument (which
+   should be the byte offset of a save backup; the caller must check this), and
+   sets the binary save to match. This does /not/ enforce the invariant that
+   binary_save_location <= gamestate_location; the caller may need to fix
+   that. The log file pointer is left immediately after the save backup. */
+static void
+load_save_backup_from_offset(long offset)
+{
+    char *logline;
+
+    program_state.binary_save_location = offset;
+    program_state.save_backup_location = offset;
+
+    lseek(program_state.logfile, offset, SEEK_SET);
     logline = lgetline_malloc(program_state.logfile);
 
     if (!logline)
@@ -2081,6 +3310,8 @@ load_save_backup_from_offset(long offset)
 
     load_save_backup_from_string(logline);
     free(logline);
+
+    log_index_add(offset, get_log_offset(), -1, TRUE);
 }
 
 /* Checks to see if a save backup exists at a given file location. Returns -1 if
@@ -2146,6 +3377,7 @@ relative_to_target(long bsl, long targetpos, enum target_location_units tlu)
 {
     long temp_pos = program_state.binary_save.pos;
     long curv;
+    int i;
 
     switch (tlu) {
 
@@ -2158,6 +3390,12 @@ relative_to_target(long bsl, long targetpos, enum target_location_units tlu)
 
     case TLU_TURNS:
 
+        /* The seek index can tell us without decoding anything. */
+        if ((i = log_index_find(bsl)) >= 0) {
+            curv = log_index[i].moves;
+            break;
+        }
+
         program_state.binary_save.pos = 0;
         if (!uptodate(&program_state.binary_save, NULL))
             error_reading_save(
@@ -2174,6 +3412,50 @@ relative_to_target(long bsl, long targetpos, enum target_location_units tlu)
     return curv - targetpos;
 }
 
+/* Returns the index entry for the latest indexed save backup that isn't ahead
+   of the target, or -1 if there isn't one. This relies on turn counts never
+   decreasing along the log. */
+static int
+log_index_seek_backup(long targetpos, enum target_location_units tlu)
+{
+    int lo = 0, hi = log_index_count;
+
+    /* Find the first entry that's ahead of the target. */
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+
+        if (relative_to_target(log_index[mid].offset, targetpos, tlu) > 0)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+
+    while (--lo >= 0)
+        if (log_index[lo].backup)
+            return lo;
+
+    return -1;
+}
+
+/* Returns the latest keyframe that isn't ahead of the target, or -1 if there
+   isn't one. */
+static int
+log_keyframe_seek(long targetpos, enum target_location_units tlu)
+{
+    int k, best = -1;
+
+    for (k = 0; k < keyframe_count; k++) {
+        if (best >= 0 && keyframes[k].offset < keyframes[best].offset)
+            continue;
+        if (tlu == TLU_TURNS ? keyframes[k].moves > targetpos :
+            relative_to_target(keyframes[k].offset, targetpos, tlu) > 0)
+            continue;
+        best = k;
+    }
+
+    return best;
+}
+
 /*
  * Fastforwards/rewinds the gamestate to the target location.
  *
@@ -2221,8 +3503,12 @@ log_sync(long target_location, enum target_location_units tlu,
 {
     struct nh_game_info si;
     struct memfile bsave;
-    long sloc, loglineloc, last_sloc;
+    struct decoded_save_line decoded = {.buf = NULL};
+    long sloc, loglineloc, logline_end, last_sloc, viewlen;
     char *logline;
+    const char *view;
+    boolean is_backup, next_known;
+    int i, lines_synced = 0;
 
     if (!change_fd_lock(program_state.logfile, TRUE, LT_READ, 2))
         panic("Could not upgrade to read lock on logfile");
@@ -2241,6 +3527,9 @@ log_sync(long target_location, enum target_location_units tlu,
             error_reading_save(
                 "logfile has a bad header (is it from an old version?)\n");
 
+        /* If we kept a seek index for this log last time, pick it up. */
+        log_index_load();
+
         /* Now we know the location that the location of the last save backup
            should be stored in. This location is only advisory, though, and
            may contain an incorrect value. We also initialize the save backup
@@ -2275,6 +3564,24 @@ log_sync(long target_location, enum target_location_units tlu,
 
     }
 
+    /* If the seek index knows of a save backup that's a better starting point
+       than where we are now (i.e. we're ahead of the target, or the backup is
+       between us and the target), jump straight to it. */
+    i = log_index_seek_backup(target_location, tlu);
+    if (i >= 0 && log_index[i].offset != program_state.binary_save_location &&
+        (log_index[i].offset > program_state.binary_save_location ||
+         relative_to_target(program_state.binary_save_location,
+                            target_location, tlu) > 0))
+        load_save_backup_from_offset(log_index[i].offset);
+
+    /* Likewise for replay keyframes, which are typically closer. */
+    i = log_keyframe_seek(target_location, tlu);
+    if (i >= 0 && keyframes[i].offset != program_state.binary_save_location &&
+        (keyframes[i].offset > program_state.binary_save_location ||
+         relative_to_target(program_state.binary_save_location,
+                            target_location, tlu) > 0))
+        log_keyframe_restore(i);
+
     /* If we're ahead of the target, move back to the last save backup (because
        we can't run save diffs backwards, our only choice is to move forwards
        from the save backup location). */
@@ -2301,12 +3608,8 @@ log_sync(long target_location, enum target_location_units tlu,
     }
 
     /* If we're behind the target, move forwards until we're at or ahead of the
-       target, via adding together diffs.
-
-       TODO: We could increase the loading speed via caching the end location of
-       the save diff / backup, rather than skipping it each time round the
-       loop. That isn't implemented yet in order to start off by getting the
-       simplest possible version of the code working. */
+       target, via adding together diffs. Where the seek index knows where the
+       next save line is, we use that rather than scanning the log for it. */
     sloc = program_state.binary_save_location;
     long loadamt;
     long orig_loadamt = 0;
@@ -2322,29 +3625,67 @@ log_sync(long target_location, enum target_location_units tlu,
             last_load_progress_time = now;
         }
 
-        lseek(program_state.logfile, sloc, SEEK_SET);
-        /* Skip the save diff or backup itself. */
-        free(lgetline_malloc(program_state.logfile));
+        /* If we know the next save line's turn count, we can check whether it
+           would overshoot without decoding it. */
+        i = log_index_find(sloc);
+        next_known = i >= 0 && i + 1 < log_index_count &&
+            log_index[i + 1].prev == sloc;
+        if (next_known && relative_to_target(log_index[i + 1].offset,
+                                             target_location, tlu) > 0)
+            break;
 
-        /* Look for the next save diff or backup line. */
-        for ((loglineloc = get_log_offset()),
-                 (logline = lgetline_malloc(program_state.logfile));
-             logline;
-             free(logline), (loglineloc = get_log_offset()),
-                 (logline = lgetline_malloc(program_state.logfile))) {
-            if (*logline == '*' || *logline == '~')
-                break;
+        logline = NULL;
+        if (pipeline_next(sloc, &decoded)) {
+
+            loglineloc = decoded.offset;
+            logline_end = decoded.end;
+            is_backup = decoded.backup;
+
+        } else if (next_known) {
+
+            /* We know where the next save line is. */
+            loglineloc = log_index[i + 1].offset;
+            lseek(program_state.logfile, loglineloc, SEEK_SET);
+            logline = lgetline_malloc(program_state.logfile);
+
+        } else {
+
+            /* Skip the save diff or backup itself. */
+            if (i >= 0)
+                lseek(program_state.logfile, log_index[i].end, SEEK_SET);
+            else {
+                lseek(program_state.logfile, sloc, SEEK_SET);
+                lskipline();
+            }
+
+            /* Look for the next save diff or backup line, skipping other lines
+               in the mapping of the log where possible. */
+            do {
+                loglineloc = get_log_offset();
+                view = lgetline_view(&viewlen);
+            } while (view && (!viewlen || (*view != '*' && *view != '~')));
+
+            if (view)
+                logline = lview_strdup(view, viewlen);
+            else
+                for ((loglineloc = get_log_offset()),
+                         (logline = lgetline_malloc(program_state.logfile));
+                     logline;
+                     free(logline), (loglineloc = get_log_offset()),
+                         (logline = lgetline_malloc(program_state.logfile))) {
+                    if (*logline == '*' || *logline == '~')
+                        break;
+                }
         }
 
-        if (!logline) {
-            /* We're at EOF. The binary save and its location are already
+        if (!decoded.buf) {
+            /* If we're at EOF, the binary save and its location are already
                correct, so we just need to get the gamestate and its location
                correct. */
-            if (!inconsistent)
-                load_gamestate_from_binary_save(TRUE);
-            if (!change_fd_lock(program_state.logfile, TRUE, LT_MONITOR, 2))
-                panic("Could not downgrade to monitor lock on logfile");
-            return;
+            if (!logline)
+                break;
+            logline_end = get_log_offset();
+            is_backup = *logline == '*';
         }
 
         /* Back up the binary save, so that we can go back if we overshoot.
@@ -2353,13 +3694,18 @@ log_sync(long target_location, enum target_location_units tlu,
         bsave = program_state.binary_save;
         program_state.binary_save_allocated = FALSE;
 
-        if (*logline == '*') {
-            /* This is a save backup. */
+        if (decoded.buf && is_backup)
+            load_decoded_save_backup(decoded.buf, decoded.len);
+        else if (decoded.buf)
+            apply_decoded_save_diff(decoded.buf, decoded.len, &bsave);
+        else if (is_backup)
             load_save_backup_from_string(logline);
-        } else if (*logline == '~') {
-            /* This is a save diff. */
+        else
             apply_save_diff(logline, &bsave);
-        }
+        free(logline);
+        decoded.buf = NULL;
+
+        log_index_add(loglineloc, logline_end, sloc, is_backup);
 
         if (relative_to_target(loglineloc, target_location, tlu) > 0) {
 
@@ -2369,29 +3715,26 @@ log_sync(long target_location, enum target_location_units tlu,
             if (!program_state.binary_save_allocated) /* should never happen */
                 panic("overshoot in log_sync but no binary save present");
 
-            free(logline);
             mfree(&program_state.binary_save);
             program_state.binary_save = bsave;
+            break;
+        }
 
-            if (!inconsistent)
-                load_gamestate_from_binary_save(TRUE);
-            if (!change_fd_lock(program_state.logfile, TRUE, LT_MONITOR, 2))
-                panic("Could not downgrade to monitor lock on logfile");
-            return;
-
-        } else {
-
-            /* We didn't overshoot: set the locations to match this new save. */
-            sloc = program_state.binary_save_location = loglineloc;
-            if (*logline == '*')
-                program_state.save_backup_location = loglineloc;
+        /* We didn't overshoot: set the locations to match this new save. */
+        sloc = program_state.binary_save_location = loglineloc;
+        if (is_backup)
+            program_state.save_backup_location = loglineloc;
 
-            mfree(&bsave);
-        }
+        mfree(&bsave);
+        log_keyframe_note(is_backup);
 
-        free(logline);
+        /* If this is turning into a long sync, start decoding ahead. */
+        if (++lines_synced == PIPELINE_THRESHOLD)
+            pipeline_start(logline_end, sloc);
     }
 
+    pipeline_stop();
+
     /* Fix the invariant on the gamestate. */
     if (!inconsistent)
         load_gamestate_from_binary_save(TRUE);
@@ -2413,6 +3756,7 @@ void
 log_replay_save_line(void)
 {
     char *logline;
+    long logline_end;
     struct memfile bsave;
 
     int tries = 30;
@@ -2429,6 +3773,7 @@ log_replay_save_line(void)
               program_state.end_of_gamestate_location, SEEK_SET);
 
         logline = lgetline_malloc(program_state.logfile);
+        logline_end = get_log_offset();
 
         if (!change_fd_lock(program_state.logfile, TRUE, LT_MONITOR, 2))
             panic("Could not downgrade to monitor lock on logfile");
@@ -2454,16 +3799,22 @@ log_replay_save_line(void)
         program_state.binary_save_allocated = FALSE;
         apply_save_diff(logline, &bsave);
         mfree(&bsave);
+        log_index_add(program_state.end_of_gamestate_location, logline_end,
+                      program_state.binary_save_location, FALSE);
         program_state.binary_save_location =
             program_state.end_of_gamestate_location;
+        log_keyframe_note(FALSE);
         load_gamestate_from_binary_save(TRUE);
 
     } else if (*logline == '*') {
 
         load_save_backup_from_string(logline);
+        log_index_add(program_state.end_of_gamestate_location, logline_end,
+                      program_state.binary_save_location, TRUE);
         program_state.binary_save_location =
             program_state.save_backup_location =
             program_state.end_of_gamestate_location;
+        log_keyframe_note(TRUE);
         load_gamestate_from_binary_save(TRUE);
 
     } else if (*logline == 'Q') {
@@ -2477,6 +3828,247 @@ log_replay_save_line(void)
     /* otherwise do nothing */
 }
 
+/***** Offline log compaction *****/
+
+/* Where save backups go in the log is decided while the game is being played,
+   using a heuristic that's cheap to calculate rather than one that produces a
+   log that's good to seek in. Once a game is over, its log will never be
+   written again, so it's safe to rewrite it into a better layout. This is done
+   losslessly: every line other than a save line is copied unchanged, and each
+   save line is replaced with either a save backup or a save diff representing
+   the same binary save. Every save diff is checked as it's applied, so a
+   corrupted log is rejected rather than being rewritten.
+
+   This runs outside any game, so errors can't use error_reading_save; they
+   jump back to nh_compact_log instead. */
+static struct compact_state {
+    nh_jmp_buf error_jmp;
+    const char *error;
+    struct memfile prev;      /* the binary save at the previous save line */
+    struct memfile cur;       /* the binary save at this save line */
+    struct memfile diff;      /* a diff from prev to cur being generated */
+    struct memfile check;     /* the result of applying that diff to prev */
+    char *line;
+    char *decoded;
+    char *encoded;
+    long outpos;              /* current offset in the output */
+} compact;
+
+static noreturn void
+compact_fail(const char *error)
+{
+    compact.error = error;
+    nh_longjmp(compact.error_jmp, 1);
+}
+
+static noreturn void
+compact_diff_error(const char *message, char *diff)
+{
+    (void) message;
+    (void) diff;
+    compact_fail("The log contains a corrupted save diff");
+}
+
+static void
+compact_write(int fd, const char *buf, long len)
+{
+    if (!full_write(fd, buf, len))
+        compact_fail("Could not write the compacted log");
+    compact.outpos += len;
+}
+
+static void
+compact_write_save_line(int fd, const char *prefix, const char *buf, long len)
+{
+    compact.encoded = malloc(base64size(len));
+    base64_encode_binary((const unsigned char *)buf, compact.encoded, len);
+    compact_write(fd, prefix, strlen(prefix));
+    compact_write(fd, compact.encoded, strlen(compact.encoded));
+    compact_write(fd, "\x0a", 1);
+    free(compact.encoded);
+    compact.encoded = NULL;
+}
+
+/* Decodes the base 64 data in s into compact.decoded, returning its length. */
+static long
+compact_decode(const char *s)
+{
+    long len = base64_strlen(s);
+    int zerr;
+
+    /* base64_decode_inner needs space for a trailing NUL */
+    compact.decoded = malloc(len + 1);
+    if (base64_decode_inner(s, compact.decoded, len + 1, &zerr))
+        compact_fail("The log contains a corrupted save line");
+    return len;
+}
+
+static void
+compact_free(void)
+{
+    mfree(&compact.prev);
+    mfree(&compact.cur);
+    mfree(&compact.diff);
+    mfree(&compact.check);
+    free(compact.line);
+    free(compact.decoded);
+    free(compact.encoded);
+    compact.line = compact.decoded = compact.encoded = NULL;
+}
+
+/* Rewrites the completed game log in infd into outfd (which must be empty and
+   seekable). A save backup is placed wherever the save diffs since the last
+   one would add up to more than seek_cost bytes, or (if seek_cost is 0 or
+   less) more than the size of a save backup. Returns NULL on success, or a
+   description of the problem. */
+const_char_p
+nh_compact_log(int infd, int outfd, long seek_cost)
+{
+    struct nh_game_info si;
+    int recovery_count, i;
+    /* volatile because they change after the setjmp; nothing reads them
+       after a longjmp, but the compiler can't tell */
+    volatile long cost = 0, first_backup = -1, last_backup = -1;
+    volatile boolean have_prev = FALSE;
+    /* "*%08lx " with room for all the digits of a long; offsets that need
+       more than 8 are rejected before this is written, though */
+    char backup_header[sizeof (long) * 2 + 3];
+
+    if (!change_fd_lock(infd, FALSE, LT_READ, 1))
+        return "The log is in use by another process";
+    if (read_log_header(infd, &si, &recovery_count, FALSE) != LS_DONE) {
+        change_fd_lock(infd, FALSE, LT_NONE, 0);
+        return "Only the logs of finished games can be compacted";
+    }
+
+    memset(&compact, 0, sizeof compact);
+    mnew(&compact.prev, NULL);
+    mnew(&compact.cur, NULL);
+    mnew(&compact.diff, NULL);
+    mnew(&compact.check, NULL);
+
+    if (nh_setjmp(compact.error_jmp)) {
+        compact_free();
+        change_fd_lock(infd, FALSE, LT_NONE, 0);
+        return compact.error;
+    }
+
+    /* The header is copied as-is. */
+    lseek(infd, 0, SEEK_SET);
+    for (i = 0; i < 3; i++) {
+        compact.line = lgetline_malloc(infd);
+        if (!compact.line)
+            compact_fail("The log's header is truncated");
+        compact_write(outfd, compact.line, strlen(compact.line));
+        compact_write(outfd, "\x0a", 1);
+        free(compact.line);
+        compact.line = NULL;
+    }
+
+    while ((compact.line = lgetline_malloc(infd))) {
+        char *s = compact.line;
+        boolean backup;
+        long len;
+
+        if (*s != '*' && *s != '~') {
+            compact_write(outfd, s, strlen(s));
+            compact_write(outfd, "\x0a", 1);
+            free(compact.line);
+            compact.line = NULL;
+            continue;
+        }
+
+        /* Reconstruct the binary save at this line. */
+        mfree(&compact.cur);
+        mnew(&compact.cur, NULL);
+        if (*s == '*') {
+            /* '*', an 8 digit hex number, and ' ', = 10 bytes */
+            if (strlen(s) < 10)
+                compact_fail("The log contains a truncated save backup");
+            len = compact_decode(s + 10);
+            memcpy(mmmap(&compact.cur, len, 0), compact.decoded, len);
+        } else {
+            if (!have_prev)
+                compact_fail("The log has a save diff before any backup");
+            len = compact_decode(s + 1);
+            mdiffapply(compact.decoded, len, &compact.prev, &compact.cur,
+                       compact_diff_error);
+        }
+        free(compact.decoded);
+        compact.decoded = NULL;
+
+        /* Work out how to represent it. An existing save diff can be copied
+           as is; a save backup that might become a diff needs a diff
+           calculating. */
+        backup = !have_prev;
+        if (!backup && *s == '*') {
+            mfree(&compact.diff);
+            mnew(&compact.diff, &compact.prev);
+            mwrite(&compact.diff, compact.cur.buf, compact.cur.pos);
+            mdiffflush(&compact.diff, 1);
+            len = compact.diff.diffpos;
+
+            mfree(&compact.check);
+            mnew(&compact.check, NULL);
+            mdiffapply(compact.diff.diffbuf, len, &compact.prev,
+                       &compact.check, compact_diff_error);
+            if (!mequal(&compact.check, &compact.cur, NULL))
+                compact_fail("Could not create a correct save diff");
+
+            /* A diff that isn't much smaller than the save isn't worth it. */
+            if (len * 2 >= compact.cur.pos)
+                backup = TRUE;
+        }
+        if (!backup &&
+            cost + len > (seek_cost > 0 ? seek_cost : compact.cur.pos))
+            backup = TRUE;
+
+        if (backup) {
+            /* The log format has room for 8 hex digits of offset. */
+            if ((unsigned long)compact.outpos > 0xffffffffUL)
+                compact_fail("The compacted log would be too large");
+
+            /* Each save backup points to the one before it; the first points
+               to the last, which we don't know yet. */
+            snprintf(backup_header, sizeof backup_header, "*%08lx ",
+                     last_backup < 0 ? 0 : last_backup);
+            if (first_backup < 0)
+                first_backup = compact.outpos;
+            last_backup = compact.outpos;
+            compact_write_save_line(outfd, backup_header, compact.cur.buf,
+                                    compact.cur.pos);
+            cost = 0;
+        } else if (*s == '~') {
+            compact_write(outfd, s, strlen(s));
+            compact_write(outfd, "\x0a", 1);
+            cost += len;
+        } else {
+            compact_write_save_line(outfd, "~", compact.diff.diffbuf,
+                                    compact.diff.diffpos);
+            cost += len;
+        }
+
+        free(compact.line);
+        compact.line = NULL;
+        mfree(&compact.prev);
+        compact.prev = compact.cur;
+        mnew(&compact.cur, NULL);
+        have_prev = TRUE;
+    }
+
+    if (first_backup >= 0) {
+        snprintf(backup_header, sizeof backup_header, "%08lx", last_backup);
+        if (lseek(outfd, first_backup + 1, SEEK_SET) < 0 ||
+            !full_write(outfd, backup_header, 8))
+            compact_fail("Could not write the compacted log");
+        lseek(outfd, 0, SEEK_END);
+    }
+
+    compact_free();
+    change_fd_lock(infd, FALSE, LT_NONE, 0);
+    return NULL;
+}
+
 /***** Memory management *****/
 
 static void
@@ -2495,6 +4087,12 @@ log_reset(void)
     program_state.last_save_backup_location_location = 0;
     program_state.emergency_recover_location = 0;
     program_state.eof_reached = FALSE;
+    binary_save_match_location = -1;
+
+    pipeline_stop();
+    log_index_free();
+    free_timing_diff_base();
+    log_keyframes_free();
 }
 
 void
@@ -2515,6 +4113,8 @@ log_init(int logfd)
 void
 log_uninit(void)
 {
+    reap_save_verification(TRUE);
+
     if (program_state.logfile > -1)
         change_fd_lock(program_state.logfile, TRUE, LT_NONE, 0);
 
@@ -2532,6 +4132,10 @@ log_uninit(void)
         mfree(&program_state.binary_save);
         program_state.binary_save_allocated = 0;
     }
+    pipeline_stop();
+    logmap_unmap();
+    log_index_free();
+    log_keyframes_free();
 
     /* just in case we have a badly-timed panic */
     program_state.emergency_recover_location = 0;
@@ -119,7 +119,40 @@ mnew(struct memfile *mf, struct memfile *relativeto)
 
     for (i = 0; i < MEMFILE_HASHTABLE_SIZE; i++)
         mf->tags[i] = 0;
+    mf->tag_blocks = NULL;
+    mf->tagcount = 0;
     mf->last_tag = 0;
+
+    /* A diff is normally against the previous save, which is likely to be
+       much the same size as this one. */
+    if (relativeto)
+        mhint_length(mf, relativeto->pos);
+}
+
+/* Allocates a tag from the memfile's tag arena. Blocks double in size, so the
+   number of allocations is logarithmic in the number of tags; the first block
+   is sized to hold as many tags as the file we're diffing against (if any). */
+static struct memfile_tag *
+mtag_alloc(struct memfile *mf)
+{
+    struct memfile_tag_block *block = mf->tag_blocks;
+
+    if (!block || block->used == block->size) {
+        int size = block ? block->size * 2 : 256;
+
+        if (!block && mf->relativeto && mf->relativeto->tagcount > size)
+            size = mf->relativeto->tagcount;
+
+        block = malloc(sizeof (struct memfile_tag_block) +
+                       size * sizeof (struct memfile_tag));
+        block->next = mf->tag_blocks;
+        block->used = 0;
+        block->size = size;
+        mf->tag_blocks = block;
+    }
+
+    mf->tagcount++;
+    return &block->tags[block->used++];
 }
 
 /* Allocates to as a deep copy of from. */
@@ -129,6 +162,8 @@ mclone(struct memfile *to, const struct memfile *from)
     int i;
 
     *to = *from;
+    to->tag_blocks = NULL;
+    to->tagcount = 0;
 
     if (from->buf) {
         to->buf = malloc(from->len);
@@ -146,7 +181,7 @@ mclone(struct memfile *to, const struct memfile *from)
         totag = &(to->tags[i]);
 
         while (fromtag) {
-            *totag = malloc(sizeof (struct memfile_tag));
+            *totag = mtag_alloc(to);
             **totag = *fromtag;
             fromtag = fromtag->next;
             totag = &((*totag)->next);
@@ -159,22 +194,18 @@ mclone(struct memfile *to, const struct memfile *from)
 void
 mfree(struct memfile *mf)
 {
-    int i;
-
     free(mf->buf);
     mf->buf = 0;
     free(mf->diffbuf);
     mf->diffbuf = 0;
-    for (i = 0; i < MEMFILE_HASHTABLE_SIZE; i++) {
-        struct memfile_tag *tag, *otag;
+    while (mf->tag_blocks) {
+        struct memfile_tag_block *next = mf->tag_blocks->next;
 
-        for ((tag = mf->tags[i]), (otag = NULL); tag; tag = tag->next) {
-            free(otag);
-            otag = tag;
-        }
-        free(otag);
-        mf->tags[i] = 0;
+        free(mf->tag_blocks);
+        mf->tag_blocks = next;
     }
+    mf->tagcount = 0;
+    memset(mf->tags, 0, sizeof mf->tags);
 }
 
 /* Functions for writing to a memory file.
@@ -189,11 +220,25 @@ static void
 expand_memfile(struct memfile *mf, long newlen)
 {
     if (mf->len < newlen) {
-        mf->len = (newlen & ~4095L) + 4096L;
+        /* Grow geometrically, so that writing a save a bit at a time doesn't
+           reallocate the buffer once per 4 KiB. */
+        long len = mf->len * 2;
+
+        if (len < newlen)
+            len = newlen;
+        mf->len = (len & ~4095L) + 4096L;
         mf->buf = realloc(mf->buf, mf->len);
     }
 }
 
+/* Tells a memory file how long it's likely to become, so that the buffer can
+   be allocated once up front (e.g. using the length of the previous save). */
+void
+mhint_length(struct memfile *mf, long len)
+{
+    expand_memfile(mf, len);
+}
+
 /* Returns a pointer to the internals of a memory file (analogous to how mmap()
    works on regular files). There is no mmunmap; rather, the pointer is only
    guaranteed to be valid up to the next call to a memory file manipulation
@@ -211,6 +256,137 @@ mmmap(struct memfile *mf, long len, long off)
     return mf->buf + off;
 }
 
+/* Run detection for diff encoding. Almost all of a save is normally identical
+   to the save it's being diffed against, so rather than comparing a byte at a
+   time, we find the lengths of runs of equal and of differing bytes in bulk.
+
+   mequalrun returns the number of bytes at the start of a and b that are
+   equal; mdiffrun returns the number of bytes at the start of a and b that
+   differ. Both stop after len bytes.
+
+   Defining MEMFILE_NO_SSE2 forces the portable versions, so that they can be
+   tested on machines that have SSE2 (see "make check"). */
+#if defined(__SSE2__) && !defined(MEMFILE_NO_SSE2)
+# include <emmintrin.h>
+
+static long
+mequalrun(const char *a, const char *b, long len)
+{
+    long i = 0;
+
+    for (; i + 16 <= len; i += 16) {
+        __m128i va = _mm_loadu_si128((const __m128i *)(a + i));
+        __m128i vb = _mm_loadu_si128((const __m128i *)(b + i));
+        unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(va, vb));
+
+        if (mask != 0xFFFFu)
+            return i + __builtin_ctz(~mask);
+    }
+    while (i < len && a[i] == b[i])
+        i++;
+    return i;
+}
+
+static long
+mdiffrun(const char *a, const char *b, long len)
+{
+    long i = 0;
+
+    for (; i + 16 <= len; i += 16) {
+        __m128i va = _mm_loadu_si128((const __m128i *)(a + i));
+        __m128i vb = _mm_loadu_si128((const __m128i *)(b + i));
+        unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(va, vb));
+
+        if (mask)
+            return i + __builtin_ctz(mask);
+    }
+    while (i < len && a[i] != b[i])
+        i++;
+    return i;
+}
+
+#else
+
+/* Portable version: compares a word at a time. A word of a ^ b has a zero byte
+   iff a and b have an equal byte in that position. */
+# define MRUN_ONES  (UINT64_C(0x0101010101010101))
+# define MRUN_HIGHS (UINT64_C(0x8080808080808080))
+# define MRUN_HAS_ZERO_BYTE(x) ((((x) - MRUN_ONES) & ~(x) & MRUN_HIGHS) != 0)
+
+static long
+mequalrun(const char *a, const char *b, long len)
+{
+    long i = 0;
+    uint64_t wa, wb;
+
+    for (; i + 8 <= len; i += 8) {
+        memcpy(&wa, a + i, 8);
+        memcpy(&wb, b + i, 8);
+        if (wa != wb)
+            break;
+    }
+    while (i < len && a[i] == b[i])
+        i++;
+    return i;
+}
+
+static long
+mdiffrun(const char *a, const char *b, long len)
+{
+    long i = 0;
+    uint64_t wa, wb;
+
+    for (; i + 8 <= len; i += 8) {
+        memcpy(&wa, a + i, 8);
+        memcpy(&wb, b + i, 8);
+        if (MRUN_HAS_ZERO_BYTE(wa ^ wb))
+            break;
+    }
+    while (i < len && a[i] != b[i])
+        i++;
+    return i;
+}
+#endif
+
+/* The diff encoder, a run at a time. Only the first byte of a run can cause a
+   flush (mdiffflush clears all the pending counts), so handling a whole run at
+   once is equivalent to handling its bytes one by one. (testbench/difffuzz
+   checks this, using single-byte writes as the one-by-one version.) */
+static void
+mwrite_diff(struct memfile *mf, unsigned int num)
+{
+    while (num) {
+        const char *newp = mf->buf + mf->pos;
+        const char *oldp = mf->relativeto->buf + mf->relativepos;
+        long avail = mf->relativeto->pos - mf->relativepos;
+        long run;
+
+        if (avail > (long)num)
+            avail = num;
+
+        if (avail > 0 && *newp == *oldp) {
+            run = mequalrun(newp, oldp, avail);
+
+            if (mf->pending_seeks || mf->pending_edits)
+                mdiffflush(mf, 0);
+
+            mf->pending_copies += run;
+
+        } else {
+            /* Beyond the end of relativeto, everything is an edit. */
+            run = avail > 0 ? mdiffrun(newp, oldp, avail) : (long)num;
+
+            if (mf->pending_seeks)
+                mdiffflush(mf, 0);
+
+            mf->pending_edits += run;
+        }
+        mf->pos += run;
+        mf->relativepos += run;
+        num -= run;
+    }
+}
+
 void
 mwrite(struct memfile *mf, const void *buf, unsigned int num)
 {
@@ -221,28 +397,7 @@ mwrite(struct memfile *mf, const void *buf, unsigned int num)
         mf->pos += num;
     } else {
         /* calculate and record the diff as well */
-        while (num--) {
-            if (mf->relativepos < mf->relativeto->pos &&
-                mf->buf[mf->pos] == mf->relativeto->buf[mf->relativepos]) {
-
-                if (mf->pending_seeks || mf->pending_edits)
-                    mdiffflush(mf, 0);
-
-                mf->pending_copies++;
-
-            } else {
-
-                /* Note that mdiffflush is responsible for writing the actual
-                   data that was edited, once we have a complete run of it. So
-                   there's no need to record the data anywhere but in buf. */
-                if (mf->pending_seeks)
-                    mdiffflush(mf, 0);
-
-                mf->pending_edits++;
-            }
-            mf->pos++;
-            mf->relativepos++;
-        }
+        mwrite_diff(mf, num);
     }
 }
 
@@ -1191,7 +1346,7 @@ mtag(struct memfile *mf, long tagdata, enum memfile_tagtype tagtype)
     /* 619 is chosen here because it's a prime number, and it's approximately
        in the golden ratio with MEMFILE_HASHTABLE_SIZE. */
     int bucket = (tagdata * 619 + (int)tagtype) % MEMFILE_HASHTABLE_SIZE;
-    struct memfile_tag *tag = malloc(sizeof (struct memfile_tag));
+    struct memfile_tag *tag = mtag_alloc(mf);
 
     tag->next = mf->tags[bucket];
     tag->tagdata = tagdata;
@@ -2101,7 +2101,7 @@ mdamageu(struct monst *mtmp, int n)
         if (u.mh < 1)
             rehumanize(DIED, killer_msg_mon(DIED, mtmp));
     } else {
-        script_call("hp_loss_modifier", n, &n);
+        script_call_hook(HOOK_HP_LOSS_MODIFIER, n, &n);
         u.uhp -= n;
         if (u.uhp < 1)
             done_in_by(mtmp, NULL);
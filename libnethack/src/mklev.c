@@ -741,15 +741,15 @@ skip0:
         if (Is_rogue_level(&lev->z))
             goto skip_nonrogue;
        
-        script_call("room.gen_fountain", &b);
+        script_call_hook(HOOK_ROOM_GEN_FOUNTAIN, mrng(), &b);
         if (b)
             mkfount(lev, 0, croom);
         
-        script_call("room.gen_sink", &b);
+        script_call_hook(HOOK_ROOM_GEN_SINK, mrng(), &b);
         if (b)
             mksink(lev, croom);
         
-        script_call("room.gen_altar", &b);
+        script_call_hook(HOOK_ROOM_GEN_ALTAR, mrng(), &b);
         if (b)
             mkaltar(lev, croom);
         
@@ -796,7 +796,8 @@ skip0:
         }
 
     skip_nonrogue: 
-        script_call("room.number_of_items",0,0,0,&num_items);
+        script_call_hook(HOOK_ROOM_NUMBER_OF_ITEMS, 0, 0, 0, mrng(),
+                         &num_items);
         if (num_items > 0) {
             for (int i = 0; i < num_items; i++) {
                 y = somey(croom, mrng());
@@ -915,6 +916,7 @@ mklev(d_level * levnum)
     if (getbones(levnum))
         return levels[ln];      /* initialized in getbones->getlev */
 
+    discard_level_save_cache(ln);
     lev = levels[ln] = alloc_level(levnum);
     init_rect(rng_for_level(levnum));
 
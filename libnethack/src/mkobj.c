@@ -14,6 +14,7 @@ static void obj_timer_checks(struct obj *, xchar, xchar, int);
 static void container_weight(struct obj *);
 static struct obj *save_mtraits(struct obj *, struct monst *);
 static void extract_nexthere(struct obj *, struct obj **);
+static void mark_obj_level_changed(struct obj *);
 
 /* #define DEBUG_EFFECTS *//* show some messages for debugging */
 
@@ -1253,6 +1254,7 @@ place_object(struct obj *otmp, struct level *lev, int x, int y)
 
     set_obj_level(lev, otmp);   /* set the level recursively for containers */
     extract_nobj(otmp, &turnstate.floating_objects, &lev->objlist, OBJ_FLOOR);
+    mark_level_changed(lev);
 
     if (otmp->timed)
         obj_timer_checks(otmp, x, y, 0);
@@ -1377,6 +1379,7 @@ remove_object(struct obj *otmp)
     extract_nexthere(otmp, &otmp->olev->objects[x][y]);
     extract_nobj(otmp, &otmp->olev->objlist,
                  &turnstate.floating_objects, OBJ_FREE);
+    mark_level_changed(otmp->olev);
     if (otmp->otyp == BOULDER && otmp->olev == level &&
         !sobj_at(BOULDER, level, x, y)) /* vision */
         unblock_point(x, y);
@@ -1384,6 +1387,28 @@ remove_object(struct obj *otmp)
         obj_timer_checks(otmp, x, y, 0);
 }
 
+/* Tells the save code that the level obj is on (if any) has changed. */
+static void
+mark_obj_level_changed(struct obj *obj)
+{
+    mark_gamestate_changed();
+    while (obj->where == OBJ_CONTAINED)
+        obj = obj->ocontainer;
+
+    switch (obj->where) {
+    case OBJ_FLOOR:
+    case OBJ_BURIED:
+    case OBJ_ONBILL:
+        mark_level_changed(obj->olev);
+        break;
+    case OBJ_MINVENT:
+        mark_level_changed(obj->ocarry->dlevel);
+        break;
+    default:
+        break;
+    }
+}
+
 /* throw away all of a monster's inventory */
 void
 discard_minvent(struct monst *mtmp)
@@ -1420,6 +1445,8 @@ discard_minvent(struct monst *mtmp)
 void
 obj_extract_self(struct obj *obj)
 {
+    mark_obj_level_changed(obj);
+
     switch (obj->where) {
     case OBJ_FREE:
         break;
@@ -1532,6 +1559,7 @@ add_to_minv(struct monst *mon, struct obj *obj)
     /* else insert; don't bother forcing it to end of chain */
     extract_nobj(obj, &turnstate.floating_objects, &mon->minvent, OBJ_MINVENT);
     obj->ocarry = mon;
+    mark_level_changed(mon->dlevel);
 
     return 0;   /* obj on mon's inventory chain */
 }
@@ -1559,6 +1587,7 @@ add_to_container(struct obj *container, struct obj *obj)
     extract_nobj(obj, &turnstate.floating_objects,
                  &container->cobj, OBJ_CONTAINED);
     obj->ocontainer = container;
+    mark_obj_level_changed(container);
     return obj;
 }
 
@@ -1571,6 +1600,7 @@ add_to_buried(struct obj *obj)
 
     extract_nobj(obj, &turnstate.floating_objects,
                  &obj->olev->buriedobjlist, OBJ_BURIED);
+    mark_level_changed(obj->olev);
 }
 
 
@@ -1559,6 +1559,7 @@ relmon(struct monst *mon)
         panic("relmon: no level->monlist available.");
 
     mon->dlevel->monsters[mon->mx][mon->my] = NULL;
+    mark_level_changed(mon->dlevel);
 
     if (mon == mon->dlevel->monlist)
         mon->dlevel->monlist = mon->dlevel->monlist->nmon;
@@ -1585,6 +1586,7 @@ m_detach(struct monst *mtmp, const struct permonst *mptr)
     relobj(mtmp, 0, FALSE);
     if (isok(mtmp->mx, mtmp->my))
         mtmp->dlevel->monsters[mtmp->mx][mtmp->my] = NULL;
+    mark_level_changed(mtmp->dlevel);
     if (emits_light(mptr))
         del_light_source(mtmp->dlevel, LS_MONSTER, mtmp);
     if (mtmp->dlevel == level && isok(mtmp->mx, mtmp->my))
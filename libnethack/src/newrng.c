@@ -20,6 +20,12 @@
 # include <wincrypt.h>
 #endif
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+# define SHA256_X86_SHA
+# include <cpuid.h>
+# include <immintrin.h>
+#endif
+
 #include "rnd.h"
 #include "flag.h"
 #include "you.h"
@@ -27,6 +33,24 @@
 #include "rm.h"
 #include <sys/time.h>
 
+/* The RNG functions are defined here, so they mustn't be wrapped. */
+#ifdef RNG_PROFILE
+# undef rn2_on_rng
+# undef rnl
+# undef rn2_on_display_rng
+# undef rn2
+# undef rnd
+# undef dice
+# undef rne_on_rng
+# undef rne
+# undef rnz_on_rng
+# undef rnz
+# undef randn_on_rng
+# undef randn
+# undef dice_normal
+# undef mklev_rn2
+#endif
+
 struct sha256_state {
     uint64_t length;
     uint32_t state[8], curlen;
@@ -76,7 +100,7 @@ sha256_init(struct sha256_state *ss)
 #define Gamma1(x)    (S(x, 17) ^ S(x, 19) ^ R(x, 10))
 
 static void
-sha256_compress(struct sha256_state *ss, const unsigned char buf[64])
+sha256_compress_portable(struct sha256_state *ss, const unsigned char buf[64])
 {
     uint32_t S[8], W[64];
     int i;
@@ -119,6 +143,125 @@ sha256_compress(struct sha256_state *ss, const unsigned char buf[64])
     }
 }
 
+#ifdef SHA256_X86_SHA
+/* The same thing, using the x86 SHA extensions. These work on the state in a
+   different order (ABEF and CDGH), and do two rounds per instruction; the
+   message schedule is calculated four words at a time, as we go. */
+__attribute__((target("sha,sse4.1")))
+static void
+sha256_compress_x86_sha(struct sha256_state *ss, const unsigned char buf[64])
+{
+    const __m128i bswap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL,
+                                         0x0405060700010203ULL);
+    __m128i state0, state1, saved0, saved1, msg, tmp, W[4];
+    int i;
+
+    /* copy state into state0 (ABEF) and state1 (CDGH) */
+    tmp = _mm_loadu_si128((const __m128i *)&ss->state[0]);
+    state1 = _mm_loadu_si128((const __m128i *)&ss->state[4]);
+    tmp = _mm_shuffle_epi32(tmp, 0xB1);
+    state1 = _mm_shuffle_epi32(state1, 0x1B);
+    state0 = _mm_alignr_epi8(tmp, state1, 8);
+    state1 = _mm_blend_epi16(state1, tmp, 0xF0);
+    saved0 = state0;
+    saved1 = state1;
+
+    /* the first 16 words of the message schedule are the (big-endian) input */
+    for (i = 0; i < 4; i++)
+        W[i] = _mm_shuffle_epi8(
+            _mm_loadu_si128((const __m128i *)(buf + i * 16)), bswap);
+
+    /* Compress, four rounds at a time; W[i & 3] holds W[4i..4i+3] */
+    for (i = 0; i < 16; i++) {
+        msg = _mm_add_epi32(W[i & 3],
+                            _mm_loadu_si128((const __m128i *)&K[i * 4]));
+        state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+        msg = _mm_shuffle_epi32(msg, 0x0E);
+        state0 = _mm_sha256rnds2_epu32(state0, state1, msg);
+
+        /* fill W[4i+16..4i+19], which replaces W[4i..4i+3] */
+        if (i < 12) {
+            tmp = _mm_alignr_epi8(W[(i + 3) & 3], W[(i + 2) & 3], 4);
+            msg = _mm_sha256msg1_epu32(W[i & 3], W[(i + 1) & 3]);
+            W[i & 3] = _mm_sha256msg2_epu32(_mm_add_epi32(msg, tmp),
+                                            W[(i + 3) & 3]);
+        }
+    }
+
+    /* feedback */
+    state0 = _mm_add_epi32(state0, saved0);
+    state1 = _mm_add_epi32(state1, saved1);
+    tmp = _mm_shuffle_epi32(state0, 0x1B);
+    state1 = _mm_shuffle_epi32(state1, 0xB1);
+    state0 = _mm_blend_epi16(tmp, state1, 0xF0);
+    state1 = _mm_alignr_epi8(state1, tmp, 8);
+    _mm_storeu_si128((__m128i *)&ss->state[0], state0);
+    _mm_storeu_si128((__m128i *)&ss->state[4], state1);
+}
+
+static boolean
+cpu_has_x86_sha(void)
+{
+    unsigned int eax, ebx, ecx, edx;
+
+    /* SSE4.1 is CPUID.1:ECX[19]; SHA is CPUID.(7,0):EBX[29] */
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx) || !(ecx & (1U << 19)))
+        return FALSE;
+    if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx))
+        return FALSE;
+    return !!(ebx & (1U << 29));
+}
+#endif
+
+static void sha256_compress_select(struct sha256_state *,
+                                   const unsigned char[64]);
+
+/* The compression function to use; picked on first use, depending on what the
+   CPU supports. */
+static void (*sha256_compress)(struct sha256_state *, const unsigned char[64])
+    = sha256_compress_select;
+
+/* Checks a compression function against the portable version. The RNG must
+   give the same results on every computer, so an implementation that doesn't
+   match exactly can't be used. */
+static boolean
+sha256_compress_matches_portable(
+    void (*compress)(struct sha256_state *, const unsigned char[64]))
+{
+    struct sha256_state ss1, ss2;
+    unsigned char block[64];
+    int i, j;
+
+    memset(&ss1, 0, sizeof ss1);
+    for (i = 0; i < 8; i++)
+        ss1.state[i] = 0x6A09E667UL * (i + 1);
+    ss2 = ss1;
+
+    for (i = 0; i < 64; i++) {
+        for (j = 0; j < 64; j++)
+            block[j] = (unsigned char)(i * 61 + j * 17 + (i ^ j));
+        sha256_compress_portable(&ss1, block);
+        compress(&ss2, block);
+        if (memcmp(ss1.state, ss2.state, sizeof ss1.state) != 0)
+            return FALSE;
+    }
+    return TRUE;
+}
+
+static void
+sha256_compress_select(struct sha256_state *ss, const unsigned char buf[64])
+{
+    sha256_compress = sha256_compress_portable;
+
+#ifdef SHA256_X86_SHA
+    if (cpu_has_x86_sha() &&
+        sha256_compress_matches_portable(sha256_compress_x86_sha))
+        sha256_compress = sha256_compress_x86_sha;
+#endif
+
+    sha256_compress(ss, buf);
+}
+
 static const int sha256_block_size = 64;
 static void
 sha256_process(struct sha256_state *ss,
@@ -325,6 +468,8 @@ seed_rng_from_initial_seed(void)
         memcpy(s, flags.rngstate, RNG_SEED_SIZE_BYTES);
         s[RNG_SEED_SIZE_BYTES - 1] += i;
     }
+
+    memset(flags.rngavail, 0, sizeof flags.rngavail);
 }
 
 void
@@ -427,31 +572,225 @@ get_initial_rng_seed(char out[static RNG_SEED_SIZE_BASE64])
 }
 
 
+/* Profiling. With RNG_PROFILE defined, we count draws and hashes per RNG and
+   per call site (as recorded by the wrappers in rnd.h); write_rng_profile
+   writes the totals to a file. */
+
+#ifdef RNG_PROFILE
+static const char *rng_profile_file = NULL;
+static int rng_profile_line = 0;
+
+static unsigned long long rng_profile_hashes = 0;
+
+struct rng_profile_count {
+    const char *file;
+    int line;
+    unsigned long long draws;
+    unsigned long long hashes;
+};
+
+# define RNG_PROFILE_SITES 4096 /* must be a power of 2 */
+
+/* Indexed by rng + 1, so that rng_display fits. */
+static struct rng_profile_count rng_profile_by_rng[RNG_COUNT + 1];
+static struct rng_profile_count rng_profile_by_site[RNG_PROFILE_SITES];
+
+static const char *const rng_names[first_level_rng] = {
+    [rng_initialseed] = "initialseed",
+    [rng_main] = "main",
+    [rng_intervention] = "intervention",
+    [rng_cursed_unihorn] = "cursed_unihorn",
+    [rng_eucalyptus] = "eucalyptus",
+    [rng_horn_of_plenty] = "horn_of_plenty",
+    [rng_artifact_invoke] = "artifact_invoke",
+    [rng_strength_gain] = "strength_gain",
+    [rng_god_anger] = "god_anger",
+    [rng_prayer_timeout] = "prayer_timeout",
+    [rng_first_protection] = "first_protection",
+    [rng_altar_convert] = "altar_convert",
+    [rng_altar_gift] = "altar_gift",
+    [rng_spellbook_gift] = "spellbook_gift",
+    [rng_armor_ench_4_5] = "armor_ench_4_5",
+    [rng_id_count] = "id_count",
+    [rng_rndcurse] = "rndcurse",
+    [rng_levport_results] = "levport_results",
+    [rng_trapdoor_result] = "trapdoor_result",
+};
+
+void
+rng_profile_site(const char *file, int line)
+{
+    rng_profile_file = file;
+    rng_profile_line = line;
+}
+
+static void
+rng_profile_record(enum rng rng, unsigned long long hashes)
+{
+    struct rng_profile_count *c = &rng_profile_by_rng[rng + 1];
+    unsigned h;
+    int n;
+
+    c->draws++;
+    c->hashes += hashes;
+
+    h = ((uintptr_t)rng_profile_file >> 2) * 31 + rng_profile_line;
+    for (n = 0; n < RNG_PROFILE_SITES; n++, h++) {
+        c = &rng_profile_by_site[h & (RNG_PROFILE_SITES - 1)];
+        if (!c->draws) {
+            c->file = rng_profile_file;
+            c->line = rng_profile_line;
+            break;
+        }
+        if (c->file == rng_profile_file && c->line == rng_profile_line)
+            break;
+    }
+    if (n == RNG_PROFILE_SITES)
+        return;        /* table full; the per-RNG counts are still right */
+
+    c->draws++;
+    c->hashes += hashes;
+}
+
+static int
+rng_profile_compare(const void *a, const void *b)
+{
+    const struct rng_profile_count *ca = a, *cb = b;
+
+    return ca->draws < cb->draws ? 1 : ca->draws > cb->draws ? -1 : 0;
+}
+#endif
+
+/* Writes the RNG profile to rngprofile.txt in the troubleshooting directory.
+   Returns FALSE if profiling isn't compiled in or the file can't be opened. */
+boolean
+write_rng_profile(void)
+{
+#ifdef RNG_PROFILE
+    struct rng_profile_count by_rng[RNG_COUNT + 1];
+    struct rng_profile_count *by_site;
+    FILE *fp;
+    int i;
+
+    fp = fopen_datafile("rngprofile.txt", "w", TROUBLEPREFIX);
+    if (!fp)
+        return FALSE;
+
+    /* Sort copies, so that counting can continue afterwards. The RNG number
+       goes in the line field, to know which is which after sorting. */
+    memcpy(by_rng, rng_profile_by_rng, sizeof by_rng);
+    for (i = 0; i < RNG_COUNT + 1; i++)
+        by_rng[i].line = i - 1;
+    qsort(by_rng, RNG_COUNT + 1, sizeof *by_rng, rng_profile_compare);
+
+    by_site = malloc(sizeof rng_profile_by_site);
+    memcpy(by_site, rng_profile_by_site, sizeof rng_profile_by_site);
+    qsort(by_site, RNG_PROFILE_SITES, sizeof *by_site, rng_profile_compare);
+
+    fprintf(fp, "# draws\thashes\trng\n");
+    for (i = 0; i < RNG_COUNT + 1 && by_rng[i].draws; i++) {
+        int rng = by_rng[i].line;
+
+        if (rng == rng_display)
+            fprintf(fp, "%llu\t%llu\tdisplay\n",
+                    by_rng[i].draws, by_rng[i].hashes);
+        else if (rng < first_level_rng)
+            fprintf(fp, "%llu\t%llu\t%s\n",
+                    by_rng[i].draws, by_rng[i].hashes,
+                    rng_names[rng] ? rng_names[rng] : "(unnamed)");
+        else
+            fprintf(fp, "%llu\t%llu\tlevel %d\n",
+                    by_rng[i].draws, by_rng[i].hashes, rng - first_level_rng);
+    }
+
+    fprintf(fp, "\n# draws\thashes\tcall site\n");
+    for (i = 0; i < RNG_PROFILE_SITES && by_site[i].draws; i++)
+        fprintf(fp, "%llu\t%llu\t%s:%d\n", by_site[i].draws,
+                by_site[i].hashes,
+                by_site[i].file ? by_site[i].file : "(unknown)",
+                by_site[i].line);
+
+    free(by_site);
+    fclose(fp);
+    return TRUE;
+#else
+    return FALSE;
+#endif
+}
+
+
 /* Generation. */
 
-static uint32_t
-rn2_from_seedarray(uint32_t maxplus1,
-                   unsigned char seedarray[static RNG_SEED_SIZE_BYTES])
+/* Calculates the SHA-256 of a seed, then increases the seed (treating it as
+   one big little-endian number). */
+static void
+hash_and_increase_seed(unsigned char seedarray[static RNG_SEED_SIZE_BYTES],
+                       uint32_t out[static 8])
 {
     struct sha256_state ss;
+    int s;
 
-    if (maxplus1 == 0) {
-        impossible("Impossible range 0 <= x < 0 for a random number");
-        maxplus1 = 1;
-    }
+#ifdef RNG_PROFILE
+    rng_profile_hashes++;
+#endif
 
-    /* Calculate the SHA-256 of the current seed. */
     sha256_init(&ss);
     sha256_process(&ss, seedarray, RNG_SEED_SIZE_BYTES);
-    uint32_t *out = sha256_done(&ss);
+    memcpy(out, sha256_done(&ss), 8 * sizeof (uint32_t));
 
-    /* Increase the seed. We treat it as one big little-endian number. */
-    int s;
     for (s = 0; s < RNG_SEED_SIZE_BYTES; s++) {
         seedarray[s]++;
         if (seedarray[s])
             break;
     }
+}
+
+/* With rngmode_buffered, each RNG uses all eight words of a hash before
+   moving onto the next seed. The words of the most recent hash are cached
+   here, together with the seed as it was after hashing; if the seed doesn't
+   match (e.g. because a save was just loaded), we recalculate them from the
+   previous seed. Only the count of unused words is part of the game state. */
+struct rng_block {
+    unsigned char seed_after[RNG_SEED_SIZE_BYTES];
+    uint32_t words[8];
+};
+
+static uint32_t
+next_word_from_seedarray(unsigned char seedarray[static RNG_SEED_SIZE_BYTES],
+                         unsigned char *avail, struct rng_block *block)
+{
+    if (*avail == 0 || *avail > 8) {
+        hash_and_increase_seed(seedarray, block->words);
+        memcpy(block->seed_after, seedarray, RNG_SEED_SIZE_BYTES);
+        *avail = 8;
+    } else if (memcmp(block->seed_after, seedarray, RNG_SEED_SIZE_BYTES)) {
+        unsigned char prev[RNG_SEED_SIZE_BYTES];
+        int s;
+
+        memcpy(prev, seedarray, RNG_SEED_SIZE_BYTES);
+        for (s = 0; s < RNG_SEED_SIZE_BYTES; s++) {
+            if (prev[s]--)
+                break;
+        }
+        hash_and_increase_seed(prev, block->words);
+        memcpy(block->seed_after, seedarray, RNG_SEED_SIZE_BYTES);
+    }
+
+    return block->words[8 - (*avail)--];
+}
+
+static uint32_t
+rn2_from_seedarray(uint32_t maxplus1,
+                   unsigned char seedarray[static RNG_SEED_SIZE_BYTES],
+                   unsigned char *avail, struct rng_block *block)
+{
+    uint32_t out[8];
+    int s;
+
+    if (maxplus1 == 0) {
+        impossible("Impossible range 0 <= x < 0 for a random number");
+        maxplus1 = 1;
+    }
 
     /* Produce output in the range 0..maxplus1-1. We look through the 32-bit
        numbers that the SHA-256 algorithm calculated, trying each one in turn to
@@ -475,16 +814,28 @@ rn2_from_seedarray(uint32_t maxplus1,
        game will tend to correspond to high return values in other games. */
     uint64_t unbiased_maximum =
         ((uint64_t)0x100000000LLU / maxplus1) * maxplus1;
-    for (s = 0; s < 8; s++) {
-        if (out[s] < unbiased_maximum)
-            return out[s] / (unbiased_maximum / maxplus1);
+
+    /* With rngmode_buffered, the words are used one at a time, in order, even
+       across calls; words that would cause modulo bias are discarded. */
+    if (flags.rng_mode >= rngmode_buffered) {
+        for (;;) {
+            uint32_t w = next_word_from_seedarray(seedarray, avail, block);
+            if (w < unbiased_maximum)
+                return w / (unbiased_maximum / maxplus1);
+        }
     }
 
-    return rn2_from_seedarray(maxplus1, seedarray);
+    for (;;) {
+        hash_and_increase_seed(seedarray, out);
+        for (s = 0; s < 8; s++) {
+            if (out[s] < unbiased_maximum)
+                return out[s] / (unbiased_maximum / maxplus1);
+        }
+    }
 }
 
-int
-rn2_on_rng(int maxplus1, enum rng rng)
+static int
+rn2_on_rng_unprofiled(int maxplus1, enum rng rng)
 {
     if (maxplus1 <= 0) {
         impossible("RNG range has less than 1 value");
@@ -500,8 +851,12 @@ rn2_on_rng(int maxplus1, enum rng rng)
            meant to be. So we can use a static variable. Also, there's no reason
            for the sequence to be particularly secure, so we can start at 0. */
         static unsigned char display_rng_seed[RNG_SEED_SIZE_BYTES] = {0};
+        static unsigned char display_rng_avail = 0;
+        static struct rng_block display_rng_block;
 
-        return (int)rn2_from_seedarray(maxplus1, display_rng_seed);
+        return (int)rn2_from_seedarray(maxplus1, display_rng_seed,
+                                       &display_rng_avail,
+                                       &display_rng_block);
 
     } else if (rng == rng_initialseed) {
 
@@ -513,8 +868,12 @@ rn2_on_rng(int maxplus1, enum rng rng)
             !program_state.gameover && !turnstate.generating_bones)
             impossible("Zero-time command used main RNG");
 
+        static struct rng_block rng_blocks[RNG_COUNT];
+
+        mark_gamestate_changed();
         return (int)rn2_from_seedarray(maxplus1,
-            flags.rngstate + rng * RNG_SEED_SIZE_BYTES);
+            flags.rngstate + rng * RNG_SEED_SIZE_BYTES,
+            flags.rngavail + rng, rng_blocks + rng);
 
     } else {
 
@@ -523,6 +882,20 @@ rn2_on_rng(int maxplus1, enum rng rng)
     }
 }
 
+int
+rn2_on_rng(int maxplus1, enum rng rng)
+{
+#ifdef RNG_PROFILE
+    unsigned long long hashes = rng_profile_hashes;
+    int rv = rn2_on_rng_unprofiled(maxplus1, rng);
+
+    rng_profile_record(rng, rng_profile_hashes - hashes);
+    return rv;
+#else
+    return rn2_on_rng_unprofiled(maxplus1, rng);
+#endif
+}
+
 /* Wrapper for functions that take an RNG as an argument. */
 int
 rn2_on_display_rng(int x)
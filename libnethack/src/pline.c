@@ -52,7 +52,7 @@ vpline(enum msg_channel msgc, boolean norepeat,
     if (lastline < 0)
         lastline += MSGCOUNT;
 
-    if (!line || !*line)
+    if (!line || !*line || program_state.verifying_save_in_background)
         return;
 
     pbuf = msgvprintf(line, the_args, TRUE);
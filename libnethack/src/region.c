@@ -229,6 +229,7 @@ add_region(struct level *lev, struct region *reg)
     reg->lev = lev;
     lev->regions[lev->n_regions] = reg;
     lev->n_regions++;
+    mark_level_changed(lev);
     /* Check for monsters inside the region */
     for (i = reg->bounding_box.lx; i <= reg->bounding_box.hx; i++)
         for (j = reg->bounding_box.ly; j <= reg->bounding_box.hy; j++) {
@@ -273,6 +274,7 @@ remove_region(struct region *reg)
     lev->regions[i] = lev->regions[lev->n_regions - 1];
     lev->regions[lev->n_regions - 1] = NULL;
     lev->n_regions--;
+    mark_level_changed(lev);
 }
 
 /* Remove all regions and clear all related data. */
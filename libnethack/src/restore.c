@@ -478,6 +478,8 @@ restgamestate(struct memfile *mf)
     restore_waterlevel(mf, lev);
 
     mread(mf, flags.rngstate, sizeof flags.rngstate);
+    if (flags.rng_mode >= rngmode_buffered)
+        mread(mf, flags.rngavail, sizeof flags.rngavail);
 
     restore_track(mf);
     restore_rndmonst_state(mf);
@@ -821,9 +823,10 @@ restore_flags(struct memfile *mf, struct flag *f)
     f->save_encoding = mread8(mf);
     f->hide_implied = mread8(mf);
     f->servermail = mread8(mf);
+    f->rng_mode = mread8(mf);
 
     /* Ignore the padding added in save.c */
-    for (i = 0; i < 108; i++)
+    for (i = 0; i < 107; i++)
         (void) mread8(mf);
 
     mread(mf, f->setseed, sizeof (f->setseed));
@@ -1127,6 +1130,7 @@ getlev(struct memfile *mf, xchar levnum, boolean ghostly)
     unsigned int lflags;
     struct level *lev;
     struct trietable *table = NULL;
+    int startpos;
 
     if (ghostly)
         clear_id_mapping();
@@ -1137,6 +1141,7 @@ getlev(struct memfile *mf, xchar levnum, boolean ghostly)
         oldfruit = loadfruitchn(mf);
 
     /* for bones files, there is fruit chain data before the level data */
+    startpos = mf->pos;
     mfmagic_check(mf, LEVEL_MAGIC);
 
     if (levels[levnum])
@@ -1325,6 +1330,11 @@ getlev(struct memfile *mf, xchar levnum, boolean ghostly)
 
     trietable_empty(&table);
 
+    if (ghostly)
+        discard_level_save_cache(levnum);
+    else
+        verify_level_save_cache(mf, levnum, startpos);
+
     return lev;
 }
 
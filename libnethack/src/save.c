@@ -85,6 +85,267 @@ GEN_SAVE_DECODE(8, 0xFF)
 GEN_SAVE_DECODE(16, 0xFFFF)
 GEN_SAVE_DECODE(32, 0xFFFFFFFF)
 
+/*
+ * Level save cache.
+ *
+ * The game is saved (and reloaded) once per turn, but most of the levels in it
+ * don't change between one turn and the next: only the current level is
+ * simulated. So for every level other than the current one, we remember the
+ * bytes that savelev produced for it (together with the memfile tags it
+ * created, which the diff code relies on), and write those out again instead of
+ * re-serializing the level, for as long as the level stays clean.
+ *
+ * A cached level is discarded when it becomes the current level, when it's
+ * (re)created, and whenever one of the primitives that change what's on a level
+ * (placing or removing objects, monsters, traps, engravings, light sources,
+ * regions and timers) is used on it; those call mark_level_changed. Changes
+ * made directly to the fields of something on a level other than the current
+ * one aren't seen that way, so such code must call mark_level_changed itself.
+ * To catch any that don't, every cached level is re-serialized and compared
+ * against the cache in debug builds, in debug mode, and under the "paranoid"
+ * save verification policy (which the testbench uses); a mismatch is reported
+ * with impossible(). Under any save encoding other than saveenc_levelrel, some
+ * level data depends on moves, so the cache is also keyed on that.
+ *
+ * When the game is restored, each level's bytes are compared against the cache
+ * (verify_level_save_cache). This only stops an entry from surviving the load
+ * of a different gamestate; it can't detect a stale entry, because the save
+ * being loaded was itself written from the cache.
+ *
+ * None of this changes the save format; the bytes written are identical to
+ * those that savelev would have written.
+ */
+struct level_save_tag {
+    long tagdata;
+    enum memfile_tagtype tagtype;
+    int pos;                    /* relative to the start of the level */
+};
+
+struct level_save_cache {
+    char *buf;
+    int len;
+    struct level_save_tag *tags;
+    int tagcount;
+    unsigned int save_encoding; /* the type of flags.save_encoding */
+    unsigned int moves;
+};
+
+static struct level_save_cache *level_save_cache[MAXLINFO];
+
+static void savelev_cached(struct memfile *mf, xchar levnum);
+
+void
+discard_level_save_cache(xchar levnum)
+{
+    struct level_save_cache *lsc = level_save_cache[levnum];
+
+    if (!lsc)
+        return;
+
+    free(lsc->buf);
+    free(lsc->tags);
+    free(lsc);
+    level_save_cache[levnum] = NULL;
+}
+
+/* A count of changes to the gamestate. It lets log_revert_command skip
+   comparing saves after a zero-time command when nothing has changed. Only the
+   common writers bump it (anything that calls mark_level_changed, plus
+   inventory, hero position and the saved RNGs), so it's a hint, not a
+   guarantee; the "paranoid" save verification policy compares regardless. */
+static unsigned long gamestate_changes;
+
+void
+mark_gamestate_changed(void)
+{
+    gamestate_changes++;
+}
+
+unsigned long
+gamestate_change_count(void)
+{
+    return gamestate_changes;
+}
+
+/* Called when something on lev is created, destroyed or moved. Changes to the
+   current level don't matter to the cache, because it's never cached, but they
+   still count as gamestate changes. */
+void
+mark_level_changed(const struct level *lev)
+{
+    int levnum;
+
+    mark_gamestate_changed();
+    if (!lev || lev == level)
+        return;
+
+    levnum = ledger_no(&lev->z);
+    if (levnum > 0 && levnum < MAXLINFO && levels[levnum] == lev)
+        discard_level_save_cache(levnum);
+}
+
+void
+free_level_save_cache(void)
+{
+    int i;
+
+    for (i = 0; i < MAXLINFO; i++)
+        discard_level_save_cache(i);
+}
+
+/* Called by getlev, when level levnum has just been restored from mf->buf,
+   starting at startpos. If the cached copy of that level isn't byte-for-byte
+   what was restored, a different gamestate was loaded, so the cache is no use
+   for it. */
+void
+verify_level_save_cache(const struct memfile *mf, xchar levnum, int startpos)
+{
+    struct level_save_cache *lsc = level_save_cache[levnum];
+
+    if (!lsc)
+        return;
+
+    if (mf->pos - startpos != lsc->len ||
+        lsc->save_encoding != flags.save_encoding ||
+        (flags.save_encoding != saveenc_levelrel && lsc->moves != moves) ||
+        memcmp(lsc->buf, mf->buf + startpos, lsc->len) != 0)
+        discard_level_save_cache(levnum);
+}
+
+/* Records the copy of level levnum that was just written to mf, starting at
+   startpos; the tags it created are those after the first first_tag tags. */
+static void
+cache_level_save(const struct memfile *mf, xchar levnum, int startpos,
+                 int first_tag)
+{
+    struct level_save_cache *lsc;
+    struct memfile_tag_block *block;
+    int i;
+
+    discard_level_save_cache(levnum);
+
+    lsc = malloc(sizeof (struct level_save_cache));
+    lsc->len = mf->pos - startpos;
+    lsc->buf = malloc(lsc->len);
+    memcpy(lsc->buf, mf->buf + startpos, lsc->len);
+    lsc->save_encoding = flags.save_encoding;
+    lsc->moves = moves;
+
+    /* Tags are allocated in order, and the tag blocks are newest first, so the
+       level's tags are the last tagcount allocated; walk them backwards. */
+    lsc->tagcount = mf->tagcount - first_tag;
+    lsc->tags = malloc(sizeof (struct level_save_tag) *
+                       (lsc->tagcount ? lsc->tagcount : 1));
+    i = lsc->tagcount;
+    for (block = mf->tag_blocks; block && i; block = block->next) {
+        int j;
+
+        for (j = block->used - 1; j >= 0 && i; j--) {
+            i--;
+            lsc->tags[i].tagdata = block->tags[j].tagdata;
+            lsc->tags[i].tagtype = block->tags[j].tagtype;
+            lsc->tags[i].pos = block->tags[j].pos - startpos;
+        }
+    }
+
+    level_save_cache[levnum] = lsc;
+}
+
+/* Whether to check cached levels against a fresh serialization. */
+static boolean
+check_level_save_cache(void)
+{
+#ifdef DEBUG
+    return TRUE;
+#else
+    return wizard || log_paranoid_saves();
+#endif
+}
+
+/* Checks a cached level against what savelev would write now. Returns FALSE
+   (having complained) if the cache is stale. */
+static boolean
+level_save_cache_current(struct level_save_cache *lsc, xchar levnum)
+{
+    struct memfile mf;
+    boolean current;
+    int i;
+
+    mnew(&mf, NULL);
+    mhint_length(&mf, lsc->len);
+    savelev(&mf, levnum);
+
+    current = mf.pos == lsc->len && mf.tagcount == lsc->tagcount &&
+        !memcmp(mf.buf, lsc->buf, lsc->len);
+    if (current) {
+        struct memfile_tag_block *block;
+
+        i = lsc->tagcount;
+        for (block = mf.tag_blocks; block && current; block = block->next) {
+            int j;
+
+            for (j = block->used - 1; j >= 0; j--) {
+                i--;
+                if (block->tags[j].tagdata != lsc->tags[i].tagdata ||
+                    block->tags[j].tagtype != lsc->tags[i].tagtype ||
+                    block->tags[j].pos != lsc->tags[i].pos) {
+                    current = FALSE;
+                    break;
+                }
+            }
+        }
+    }
+    mfree(&mf);
+
+    if (!current)
+        impossible("Level %d changed without its save cache being discarded",
+                   (int)levnum);
+    return current;
+}
+
+static void
+savelev_cached(struct memfile *mf, xchar levnum)
+{
+    struct level_save_cache *lsc = level_save_cache[levnum];
+    int startpos = mf->pos;
+    int written = 0;
+    int i;
+
+    /* The current level changes all the time, so there's no point in caching
+       it; likewise, a level with dead monsters pending is about to change. */
+    if (levels[levnum] == level || levels[levnum]->flags.purge_monsters) {
+        discard_level_save_cache(levnum);
+        savelev(mf, levnum);
+        return;
+    }
+
+    if (lsc && (lsc->save_encoding != flags.save_encoding ||
+                (flags.save_encoding != saveenc_levelrel &&
+                 lsc->moves != moves)))
+        lsc = NULL;
+
+    if (lsc && check_level_save_cache() &&
+        !level_save_cache_current(lsc, levnum))
+        lsc = NULL;
+
+    if (!lsc) {
+        int first_tag = mf->tagcount;
+
+        savelev(mf, levnum);
+        cache_level_save(mf, levnum, startpos, first_tag);
+        return;
+    }
+
+    /* Replay the cached copy, through mwrite so that diffing works as normal,
+       recreating the tags at the points they were originally made. */
+    for (i = 0; i < lsc->tagcount; i++) {
+        mwrite(mf, lsc->buf + written, lsc->tags[i].pos - written);
+        written = lsc->tags[i].pos;
+        mtag(mf, lsc->tags[i].tagdata, lsc->tags[i].tagtype);
+    }
+    mwrite(mf, lsc->buf + written, lsc->len - written);
+}
+
 /* The save code itself. */
 
 void
@@ -121,7 +382,7 @@ savegame(struct memfile *mf)
             continue;
         mtag(mf, ltmp, MTAG_LEVELS);
         mwrite8(mf, ltmp);      /* level number */
-        savelev(mf, ltmp);      /* actual level */
+        savelev_cached(mf, ltmp);       /* actual level */
     }
     savegamestate(mf);
 
@@ -206,11 +467,12 @@ save_flags(struct memfile *mf)
     mwrite8(mf, flags.save_encoding);
     mwrite8(mf, flags.hide_implied);
     mwrite8(mf, flags.servermail);
+    mwrite8(mf, flags.rng_mode);
 
     /* Padding to allow options to be added without breaking save compatibility;
        add new options just before the padding, then remove the same amount of
        padding */
-    for (i = 0; i < 108; i++)
+    for (i = 0; i < 107; i++)
         mwrite8(mf, 0);
 
     mwrite(mf, flags.setseed, sizeof (flags.setseed));
@@ -320,6 +582,8 @@ savegamestate(struct memfile *mf)
 
     mtag(mf, 0, MTAG_RNGSTATE);
     mwrite(mf, flags.rngstate, sizeof flags.rngstate);
+    if (flags.rng_mode >= rngmode_buffered)
+        mwrite(mf, flags.rngavail, sizeof flags.rngavail);
 
     save_track(mf);
     save_rndmonst_state(mf);
@@ -728,6 +992,7 @@ freelev(xchar levnum)
 
     free(lev);
     levels[levnum] = NULL;
+    discard_level_save_cache(levnum);
 }
 
 
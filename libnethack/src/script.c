@@ -1,10 +1,12 @@
 #include "nhcurses.h"
 #include "script.h"
 #include "hack.h"
+#include "dlb.h"
 
 
 static const struct luaL_Reg nethacklib [] = {
     {"GetPlayer", scripting_GetPlayerInfo},
+    {"rn2", scripting_rn2},
     {NULL, NULL}
 };
 
@@ -13,7 +15,6 @@ int luaopen_nethacklib(lua_State* L) {
     for (int i = 0; nethacklib[i].name != NULL; i++) {
         lua_pushcfunction(L, nethacklib[i].func);
         lua_setfield(L,-2, nethacklib[i].name);
-        printf("%s\n", nethacklib[i].name);
     }
     lua_setglobal(L, "API");
     return 1;
@@ -23,29 +24,436 @@ int luaopen_nethacklib(lua_State* L) {
 
 lua_State* Lua;
 
+// Indexed by enum script_hook.
 const char* sig_table[][2] = {
-    {"hp_loss_modifier", "i>i"},
-    {"room.number_of_items", "iii>i"},
-    {"room.gen_altar", ">b"},
-    {"room.gen_fountain", ">b"},
-    {"room.gen_sink", ">b"},
-    {NULL, NULL}
+    [HOOK_HP_LOSS_MODIFIER] = {"hp_loss_modifier", "i>i"},
+    [HOOK_ROOM_NUMBER_OF_ITEMS] = {"room.number_of_items", "iiii>i"},
+    [HOOK_ROOM_GEN_ALTAR] = {"room.gen_altar", "i>b"},
+    [HOOK_ROOM_GEN_FOUNTAIN] = {"room.gen_fountain", "i>b"},
+    [HOOK_ROOM_GEN_SINK] = {"room.gen_sink", "i>b"},
+    [HOOK_COUNT] = {NULL, NULL}
 };
 
+// Registry references to the hook functions, set up by start_Lua().
+static int hook_refs[HOOK_COUNT];
+
 // TODO: Make list dynamic.
 const char* scripts[] = { "header.lua", "ruleset.lua", "room.lua", NULL};
 
-// TODO: Cross platform support.
+struct dlb_reader {
+    dlb* fp;
+    char buf[BUFSZ];
+};
+
+static const char* read_from_dlb(lua_State* L, void* data, size_t* size) {
+    struct dlb_reader* reader = data;
+    int n;
+
+    (void) L;
+    n = dlb_fread(reader->buf, 1, sizeof reader->buf, reader->fp);
+    *size = n > 0 ? n : 0;
+    return n > 0 ? reader->buf : NULL;
+}
+
+// Loads and runs a ruleset script. Normally this is the bytecode that the
+// build compiled into the data library (as "header.luac" for "header.lua",
+// and so on). If NH4RULESETDIR is set, the source in that directory is used
+// instead, so that an operator can change the ruleset without rebuilding.
 int load_script(const char* script_name) {
-    char path[1024];
-    sprintf(path, "./ruleset/%s", script_name);
-    return luaL_dofile(Lua, path);
+    const char* dir = getenv("NH4RULESETDIR");
+    char path[BUFSZ];
+    struct dlb_reader reader;
+    int status;
+
+    if (dir && *dir) {
+        snprintf(path, sizeof path, "%s/%s", dir, script_name);
+        return luaL_dofile(Lua, path);
+    }
+
+    snprintf(path, sizeof path, "%sc", script_name);
+    reader.fp = dlb_fopen(path, RDBMODE);
+    if (!reader.fp) {
+        lua_pushfstring(Lua, "cannot open %s in the data library", path);
+        return LUA_ERRFILE;
+    }
+    status = lua_load(Lua, read_from_dlb, &reader, script_name, "b");
+    dlb_fclose(reader.fp);
+
+    if (status == LUA_OK)
+        status = lua_pcall(Lua, 0, LUA_MULTRET, 0);
+    return status;
+}
+
+
+// Pushes the value that a dotted name (such as "room.gen_altar") refers to,
+// or nil if there isn't one.
+static void push_global(const char* name) {
+    const char* dot;
+
+    lua_pushglobaltable(Lua);
+    for (;;) {
+        dot = strchr(name, '.');
+        lua_pushlstring(Lua, name, dot ? (size_t)(dot - name) : strlen(name));
+        lua_gettable(Lua, -2);
+        lua_remove(Lua, -2);
+        if (!dot)
+            break;
+        if (!lua_istable(Lua, -1)) {
+            lua_pop(Lua, 1);
+            lua_pushnil(Lua);
+            break;
+        }
+        name = dot + 1;
+    }
+}
+
+// Finds the function that a hook name refers to, and keeps a reference to it
+// in the registry. Returns LUA_NOREF if there isn't one.
+static int resolve_hook(const char* name) {
+    push_global(name);
+    if (!lua_isfunction(Lua, -1)) {
+        lua_pop(Lua, 1);
+        return LUA_NOREF;
+    }
+    return luaL_ref(Lua, LUA_REGISTRYINDEX);
+}
+
+// Reads a numeric tunable from the ruleset. Returns FALSE (leaving *value
+// alone) if the ruleset doesn't set it.
+static boolean get_tunable(const char* name, double* value) {
+    boolean found;
+
+    push_global(name);
+    found = lua_type(Lua, -1) == LUA_TNUMBER;
+    if (found)
+        *value = lua_tonumber(Lua, -1);
+    lua_pop(Lua, 1);
+    return found;
+}
+
+static int get_chance_tunable(const char* name, int def) {
+    double value = def;
+
+    get_tunable(name, &value);
+    return value < 1 ? 0 : (int)value;
+}
+
+// Native versions of the hooks. A hook that the ruleset doesn't define as a
+// function runs one of these instead of going through Lua; they take their
+// arguments in the same way as the scripted version, and read the ruleset's
+// tunables once, in read_native_tunables(). The defaults are the behaviour
+// of NetHack without a ruleset.
+//
+// The room hooks are given the level generation RNG (an enum rng) as their
+// last argument, and roll on it, as the rest of mklev does: level contents
+// then only depend on the seed, not on what the player has done, and the main
+// RNG isn't disturbed.
+static boolean hp_loss_scaled;
+static double hp_loss_factor = 1.0;
+static int altar_chance, fountain_chance, sink_chance;
+static int item_chance, item_rne;
+
+static void read_native_tunables(void) {
+    hp_loss_scaled = get_tunable("hp_loss_factor", &hp_loss_factor);
+    altar_chance = get_chance_tunable("room.altar_chance", 60);
+    fountain_chance = get_chance_tunable("room.fountain_chance", 10);
+    sink_chance = get_chance_tunable("room.sink_chance", 60);
+    item_chance = get_chance_tunable("room.item_chance", 3);
+    item_rne = get_chance_tunable("room.item_rne", 5);
+}
+
+static void native_hp_loss_modifier(va_list vl) {
+    int n = va_arg(vl, int);
+
+    if (hp_loss_scaled) {
+        n = (int)floor(n * hp_loss_factor + 0.5);
+        if (n < 1)
+            n = 1;
+    }
+    *va_arg(vl, int *) = n;
+}
+
+static void native_room_number_of_items(va_list vl) {
+    int n = 0;
+    enum rng rng;
+
+    (void) va_arg(vl, int);    /* size_x */
+    (void) va_arg(vl, int);    /* size_y */
+    (void) va_arg(vl, int);    /* z */
+    rng = va_arg(vl, int);
+    if (item_chance && !rn2_on_rng(item_chance, rng)) {
+        n = 1;
+        while (item_rne > 1 && !rn2_on_rng(item_rne, rng))
+            n++;
+    }
+    *va_arg(vl, int *) = n;
+}
+
+static void native_room_gen_altar(va_list vl) {
+    enum rng rng = va_arg(vl, int);
+
+    *va_arg(vl, int *) = altar_chance && !rn2_on_rng(altar_chance, rng);
+}
+
+static void native_room_gen_fountain(va_list vl) {
+    enum rng rng = va_arg(vl, int);
+
+    *va_arg(vl, int *) = fountain_chance && !rn2_on_rng(fountain_chance, rng);
+}
+
+static void native_room_gen_sink(va_list vl) {
+    enum rng rng = va_arg(vl, int);
+
+    *va_arg(vl, int *) = sink_chance && !rn2_on_rng(sink_chance, rng);
+}
+
+static void (*const hook_natives[HOOK_COUNT])(va_list) = {
+    [HOOK_HP_LOSS_MODIFIER] = native_hp_loss_modifier,
+    [HOOK_ROOM_NUMBER_OF_ITEMS] = native_room_number_of_items,
+    [HOOK_ROOM_GEN_ALTAR] = native_room_gen_altar,
+    [HOOK_ROOM_GEN_FOUNTAIN] = native_room_gen_fountain,
+    [HOOK_ROOM_GEN_SINK] = native_room_gen_sink,
+};
+
+// Profiling. Once it's been turned on, every hook call is counted and timed;
+// it's on from the start if NH4LUAPROFILE is set, and otherwise from the first
+// #luaprofile. (Reading the clock costs more than a native hook, so it isn't
+// done unless someone's asked.) The allocator given to Lua always keeps track
+// of how much memory the ruleset uses. write_script_profile() writes the
+// figures out; it's called by #luaprofile, and at exit if NH4LUAPROFILE is set.
+#define PROFILE_BUCKETS 40
+
+struct hook_profile {
+    unsigned long long calls;
+    unsigned long long total_ns;
+    unsigned long long max_ns;
+    // buckets[b] counts calls that took from 2^b to 2^(b+1) - 1 ns.
+    unsigned long long buckets[PROFILE_BUCKETS];
+};
+
+static struct hook_profile hook_profiles[HOOK_COUNT];
+static boolean profiling;
+
+static struct {
+    size_t current, peak;
+    unsigned long long allocs, total, limit_hits;
+} lua_memory;
+
+static long long profile_clock(void) {
+#ifdef AIMAKE_BUILDOS_MSWin32
+    return (long long)clock() * (1000000000LL / CLOCKS_PER_SEC);
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+#endif
+}
+
+static void profile_hook(enum script_hook hook, long long ns) {
+    struct hook_profile* p = &hook_profiles[hook];
+    int b = 0;
+
+    if (ns < 0)
+        ns = 0;
+    while (b < PROFILE_BUCKETS - 1 && (ns >> (b + 1)))
+        b++;
+
+    p->calls++;
+    p->total_ns += ns;
+    if ((unsigned long long)ns > p->max_ns)
+        p->max_ns = ns;
+    p->buckets[b]++;
+}
+
+// Lua's allocator. Small blocks, which are most of what the ruleset's tables
+// and strings need, come from per-size-class free lists carved out of larger
+// chunks; bigger ones use realloc. The total is capped at lua_memory_limit
+// (NH4LUAMEMLIMIT megabytes, if set, else DEFAULT_LUA_MEMORY_LIMIT bytes):
+// when a request would go over, this fails it, and Lua then runs an emergency
+// collection and, if that didn't free enough, raises a memory error in the
+// hook that asked.
+#define POOL_GRANULE 16
+#define POOL_CLASSES 16    // pooled sizes go up to POOL_GRANULE * POOL_CLASSES
+#define POOL_CHUNK_SIZE 65536
+
+struct pool_block {
+    struct pool_block* next;
+};
+
+static struct pool_block* pool_free[POOL_CLASSES];
+static char* pool_next;    // the unused part of the newest chunk
+static char* pool_end;
+static size_t lua_memory_limit = DEFAULT_LUA_MEMORY_LIMIT;
+
+static int pool_class(size_t size) {
+    if (size == 0 || size > POOL_GRANULE * POOL_CLASSES)
+        return -1;
+    return (size - 1) / POOL_GRANULE;
+}
+
+static void* pool_get(int class) {
+    size_t size = (class + 1) * POOL_GRANULE;
+    struct pool_block* block = pool_free[class];
+
+    if (block) {
+        pool_free[class] = block->next;
+        return block;
+    }
+
+    // Any space left over at the end of the old chunk is abandoned; it's
+    // smaller than the largest size class.
+    if ((size_t)(pool_end - pool_next) < size) {
+        pool_next = malloc(POOL_CHUNK_SIZE);
+        if (!pool_next) {
+            pool_end = NULL;
+            return NULL;
+        }
+        pool_end = pool_next + POOL_CHUNK_SIZE;
+    }
+    block = (struct pool_block*)pool_next;
+    pool_next += size;
+    return block;
 }
 
+static void pool_release(void* ptr, int class) {
+    struct pool_block* block = ptr;
+
+    if (class < 0) {
+        free(ptr);
+        return;
+    }
+    block->next = pool_free[class];
+    pool_free[class] = block;
+}
+
+void* script_alloc(void* ud, void* ptr, size_t osize, size_t nsize) {
+    int oclass, nclass;
+    void* newptr;
+
+    (void) ud;
+    if (!ptr)
+        osize = 0;    // Lua passes a type code in osize for new blocks
+    oclass = pool_class(osize);
+
+    if (nsize == 0) {
+        pool_release(ptr, oclass);
+        lua_memory.current -= osize;
+        return NULL;
+    }
+
+    if (nsize > osize &&
+        lua_memory.current + (nsize - osize) > lua_memory_limit) {
+        lua_memory.limit_hits++;
+        return NULL;
+    }
+
+    nclass = pool_class(nsize);
+    if (nclass >= 0 && nclass == oclass)
+        newptr = ptr;
+    else if (nclass < 0 && oclass < 0)
+        newptr = realloc(ptr, nsize);
+    else {
+        newptr = nclass >= 0 ? pool_get(nclass) : malloc(nsize);
+        if (!newptr && nsize < osize) {
+            // Lua doesn't allow shrinking to fail, so keep the block. A
+            // pooled block is bigger than its new class needs, so it can
+            // simply be released into that class later; a malloc'd one is
+            // resized to the class so that it can join the pool the same
+            // way. (Pooled blocks are carved out of chunks, so they mustn't
+            // be passed to realloc.)
+            if (oclass >= 0)
+                newptr = ptr;
+            else {
+                newptr = realloc(ptr, (nclass + 1) * POOL_GRANULE);
+                if (!newptr)
+                    return NULL;
+            }
+        } else if (newptr && ptr) {
+            memcpy(newptr, ptr, osize < nsize ? osize : nsize);
+            pool_release(ptr, oclass);
+        }
+    }
+    if (!newptr)
+        return NULL;
+
+    lua_memory.current += nsize - osize;
+    if (lua_memory.current > lua_memory.peak)
+        lua_memory.peak = lua_memory.current;
+    if (nsize > osize) {
+        lua_memory.allocs++;
+        lua_memory.total += nsize - osize;
+    }
+    return newptr;
+}
+
+static int lua_panic(lua_State* L) {
+    printf("PANIC: unprotected error in call to Lua API (%s)\n",
+           lua_tostring(L, -1));
+    return 0;
+}
+
+// Starts timing hook calls, if that isn't already happening. Returns FALSE if
+// it was already on.
+boolean start_script_profile(void) {
+    if (profiling)
+        return FALSE;
+    profiling = TRUE;
+    return TRUE;
+}
+
+// Writes the hook profile to luaprofile.txt in the troubleshooting directory.
+// Returns FALSE if the file can't be opened.
+boolean write_script_profile(void) {
+    FILE* fp = fopen_datafile("luaprofile.txt", "w", TROUBLEPREFIX);
+
+    if (!fp)
+        return FALSE;
+
+    fprintf(fp, "# calls\ttotal_ns\tmean_ns\tmax_ns\ttype\thook\n");
+    for (int i = 0; i < HOOK_COUNT; i++) {
+        struct hook_profile* p = &hook_profiles[i];
+
+        fprintf(fp, "%llu\t%llu\t%llu\t%llu\t%s\t%s\n", p->calls,
+                p->total_ns, p->calls ? p->total_ns / p->calls : 0,
+                p->max_ns, hook_refs[i] == LUA_NOREF ? "native" : "scripted",
+                sig_table[i][0]);
+    }
+
+    fprintf(fp, "\n# calls\tmin_ns\tmax_ns\thook\n");
+    for (int i = 0; i < HOOK_COUNT; i++) {
+        for (int b = 0; b < PROFILE_BUCKETS; b++) {
+            if (hook_profiles[i].buckets[b])
+                fprintf(fp, "%llu\t%llu\t%llu\t%s\n",
+                        hook_profiles[i].buckets[b],
+                        b ? 1ULL << b : 0ULL, (2ULL << b) - 1,
+                        sig_table[i][0]);
+        }
+    }
+
+    fprintf(fp, "\n# Lua memory: current\tpeak\tallocations\tallocated\t"
+            "limit\tlimit_hits\n");
+    fprintf(fp, "%zu\t%zu\t%llu\t%llu\t%zu\t%llu\n", lua_memory.current,
+            lua_memory.peak, lua_memory.allocs, lua_memory.total,
+            lua_memory_limit, lua_memory.limit_hits);
+
+    fclose(fp);
+    return TRUE;
+}
 
 // Initializes the lua scripting interface.
 int start_Lua() {
-    Lua = luaL_newstate();
+    const char* limit = getenv("NH4LUAMEMLIMIT");
+
+    if (limit && atoi(limit) > 0)
+        lua_memory_limit = (size_t)atoi(limit) * 1024 * 1024;
+    if (getenv("NH4LUAPROFILE"))
+        profiling = TRUE;
+    Lua = lua_newstate(script_alloc, NULL);
+    if (!Lua) {
+        printf("start_Lua(): Could not create a Lua state.\nExiting...\n");
+        exit(0);
+    }
+    lua_atpanic(Lua, lua_panic);
     luaL_openlibs(Lua);
     luaopen_nethacklib(Lua);
     
@@ -57,6 +465,19 @@ int start_Lua() {
         }
     }
 
+    // Look up the hooks now, rather than on every call. (This means that a
+    // script can't replace a hook function once it's been loaded.) Hooks
+    // the ruleset leaves undefined use their native version. (Which hooks
+    // are scripted is recorded in the profile.)
+    read_native_tunables();
+    for (int i = 0; i < HOOK_COUNT; i++) {
+        hook_refs[i] = resolve_hook(sig_table[i][0]);
+        if (hook_refs[i] == LUA_NOREF && !hook_natives[i]) {
+            printf("start_Lua(): %s is not defined as a function.\nExiting...\n", sig_table[i][0]);
+            exit(0);
+        }
+    }
+
     return 0;
 }
 
@@ -94,25 +515,25 @@ void print_stack() {
     fclose(fout);
 }
 
-void script_call(const char *func, ...) {
-    const char* sig = get_sig(func); 
-    
+// Calls the Lua function for a hook.
+static boolean call_lua_hook(enum script_hook hook, va_list vl) {
+    const char* func = sig_table[hook][0];
+    const char* sig = sig_table[hook][1];
+
     /* Get top of stack */
     int stack_top = lua_gettop(Lua);
-    char buf[256];
-   
-    // __f = function that we want to call.
-    sprintf(buf, "__f = %s", func);
-    luaL_dostring(Lua, buf);
-    
-    va_list vl;
+
     int narg, nres;  /* number of arguments and results */
-    va_start(vl, func);
-    lua_getglobal(Lua, "__f");  /* push function */
+    int status;
+    lua_rawgeti(Lua, LUA_REGISTRYINDEX, hook_refs[hook]);  /* push function */
 
     for (narg = 0; *sig; narg++) {  /* repeat for each argument */
         /* check stack space */
-        luaL_checkstack(Lua, 1, "too many arguments");
+        if (!lua_checkstack(Lua, 1)) {
+            impossible("Too many arguments calling %s", func);
+            lua_settop(Lua, stack_top);
+            return FALSE;
+        }
         switch (*sig++) {
             case 'd':  /* double argument */
                 lua_pushnumber(Lua, va_arg(vl, double));
@@ -126,14 +547,21 @@ void script_call(const char *func, ...) {
             case '>':  /* end of arguments */
                 goto endargs;  /* break the loop */
             default:
-                error(Lua, "invalid option (%c)", *(sig - 1));
+                impossible("Invalid signature for %s (%c)", func, *(sig - 1));
+                lua_settop(Lua, stack_top);
+                return FALSE;
         }
     }
     endargs:
     nres = strlen(sig);  /* number of expected results */
-    if (lua_pcall(Lua, narg, nres, 0) != 0)  /* do the call */
-        error(Lua, "error calling '%s': %s", func,
-    lua_tostring(Lua, -1));
+    status = lua_pcall(Lua, narg, nres, 0);  /* do the call */
+    if (status != LUA_OK) {
+        impossible("%s calling %s: %s",
+                   status == LUA_ERRMEM ? "Out of memory" : "Error", func,
+                   lua_tostring(Lua, -1) ? lua_tostring(Lua, -1) : "?");
+        lua_settop(Lua, stack_top);
+        return FALSE;
+    }
     nres = -nres;  /* stack index of first result */
     while (*sig) {  /* repeat for each result */
         switch (*sig++) {
@@ -141,7 +569,7 @@ void script_call(const char *func, ...) {
                 int isnum;
                 double n = lua_tonumberx(Lua, nres, &isnum);
                 if (!isnum)
-                    error(Lua, "wrong result type");
+                    goto wrongtype;
                 *va_arg(vl, double *) = n;
                 break;
             }
@@ -149,14 +577,14 @@ void script_call(const char *func, ...) {
                 int isnum;
                 int n = lua_tointegerx(Lua, nres, &isnum);
                 if (!isnum)
-                    error(Lua, "wrong result type");
+                    goto wrongtype;
                 *va_arg(vl, int *) = n;
                 break;
             }
             case 's': {  /* string result */
                 const char *s = lua_tostring(Lua, nres);
                 if (s == NULL)
-                    error(Lua, "wrong result type");
+                    goto wrongtype;
                 *va_arg(vl, const char **) = s;
                 break;
             }
@@ -166,15 +594,59 @@ void script_call(const char *func, ...) {
                 break;
             }
             default:
-                error(Lua, "invalid option (%c)", *(sig - 1));
+                goto wrongtype;
         }
         nres++;
     }
-    va_end(vl);
-    // __f unassigned
-    luaL_dostring(Lua, "__f = nil");
     // Reset stack value
     lua_settop(Lua, stack_top);
+    return TRUE;
+
+wrongtype:
+    impossible("%s returned the wrong type of result", func);
+    lua_settop(Lua, stack_top);
+    return FALSE;
+}
+
+// Calls a hook. The arguments are as described by the hook's signature in
+// sig_table: first the values of the arguments, then pointers to where to
+// store the results.
+static void script_vcall(enum script_hook hook, va_list vl) {
+    long long start = profiling ? profile_clock() : 0;
+    va_list copy;
+
+    // If the scripted version fails, the native one supplies the results.
+    va_copy(copy, vl);
+    if (hook_refs[hook] == LUA_NOREF)
+        hook_natives[hook](vl);
+    else if (!call_lua_hook(hook, vl) && hook_natives[hook])
+        hook_natives[hook](copy);
+    va_end(copy);
+
+    if (profiling)
+        profile_hook(hook, profile_clock() - start);
+}
+
+void script_call_hook(enum script_hook hook, ...) {
+    va_list vl;
+
+    va_start(vl, hook);
+    script_vcall(hook, vl);
+    va_end(vl);
+}
+
+// Calls a hook by name; script_call_hook() is faster.
+void script_call(const char *func, ...) {
+    va_list vl;
+    int hook;
+
+    get_sig(func);  /* exits if the hook doesn't exist */
+    for (hook = 0; strcmp(sig_table[hook][0], func) != 0; hook++)
+        ;
+
+    va_start(vl, func);
+    script_vcall(hook, vl);
+    va_end(vl);
 }
 
 // You Have functions
@@ -188,6 +660,19 @@ int scripting_YouHaveBell(lua_State *L) {
     return 1;
 }
 
+// API.rn2(n[, rng]): a random integer from 0 to n - 1, rolled on the given
+// RNG (as passed to a hook), or on the main RNG if none is given. Scripts
+// should use this rather than math.random, so that games replay the same.
+int scripting_rn2(lua_State *L) {
+    lua_Integer n = luaL_checkinteger(L, 1);
+    lua_Integer rng = luaL_optinteger(L, 2, rng_main);
+
+    luaL_argcheck(L, n > 0 && n <= INT_MAX, 1, "out of range");
+    luaL_argcheck(L, rng >= 0 && rng < RNG_COUNT, 2, "not an RNG");
+    lua_pushinteger(L, rn2_on_rng((int)n, (enum rng)rng));
+    return 1;
+}
+
 int scripting_YouHaveBook(lua_State *L) {
     lua_pushboolean(L, Uhave_book == NULL ? 0:1);
     return 1;
@@ -168,6 +168,9 @@ shkgone(struct monst *mtmp)
     char *p;
     int sx, sy;
 
+    /* the shopkeeper might not have died on their shop level */
+    discard_level_save_cache(ledger_no(&eshk->shoplevel));
+
     remove_damage(mtmp, TRUE);
     sroom->resident = NULL;
 
@@ -2945,6 +2948,7 @@ remove_damage(struct monst *shkp, boolean croaked)
     uchar saw_walls = 0;
     struct level *lev = levels[ledger_no(&ESHK(shkp)->shoplevel)];
 
+    discard_level_save_cache(ledger_no(&ESHK(shkp)->shoplevel));
     tmp_dam = lev->damagelist;
     tmp2_dam = 0;
     while (tmp_dam) {
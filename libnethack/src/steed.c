@@ -652,6 +652,7 @@ place_monster(struct monst *mon, int x, int y)
         mon->dlevel->monsters[x][y] = mon;
     else
         impossible("placing monster on invalid spot (%d,%d)", x, y);
+    mark_level_changed(mon->dlevel);
 
     /* If a monster's moved to the location it believes the player to be on,
        it'll learn the player isn't there. */
@@ -266,6 +266,7 @@ teleds(int nux, int nuy, boolean allow_drag)
             }
         }
     }
+    mark_gamestate_changed();
     u.utrap = 0;
     u.ustuck = 0;
     u.ux0 = u.ux;
@@ -1336,6 +1336,7 @@ start_timer(struct level *lev, long when, short kind, short func_index,
     gnu->func_index = func_index;
     gnu->arg = arg;
     insert_timer(lev, gnu);
+    mark_level_changed(lev);
 
     if (kind == TIMER_OBJECT)   /* increment object's timed count */
         ((struct obj *)arg)->timed++;
@@ -1358,6 +1359,7 @@ stop_timer(struct level *lev, short func_index, void *arg)
     doomed = remove_timer(&lev->lev_timers, func_index, arg);
 
     if (doomed) {
+        mark_level_changed(lev);
         timeout = doomed->timeout;
         if (doomed->kind == TIMER_OBJECT)
             ((struct obj *)arg)->timed--;
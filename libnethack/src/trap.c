@@ -308,6 +308,7 @@ maketrap(struct level *lev, int x, int y, int typ, enum rng rng)
         ttmp->launch.y = -1;
     }
     ttmp->ttyp = typ;
+    mark_level_changed(lev);
     switch (typ) {
     case STATUE_TRAP:  /* create a "living" statue */
         {
@@ -4133,6 +4134,7 @@ deltrap(struct level *lev, struct trap *trap)
         ttmp->ntrap = trap->ntrap;
     }
     dealloc_trap(trap);
+    mark_level_changed(lev);
 }
 
 boolean
@@ -5,6 +5,10 @@
 
 #include "hack.h"
 
+#ifdef __SSE2__
+# include <emmintrin.h>
+#endif
+
 /* Circles ==================================================================*/
 
 /*
@@ -87,9 +91,50 @@ static char cs_rmin1[ROWNO], cs_rmax1[ROWNO];
 static char viz_clear[ROWNO][COLNO];    /* vision clear/blocked map */
 static char *viz_clear_rows[ROWNO];
 
+/*
+ * Bit-packed rows.  Column col of a row is bit (col & 63) of word (col >> 6).
+ * viz_clear_bits is a packed copy of viz_clear, kept in step with it, so that
+ * runs of locations can be tested a word at a time.
+ */
+#define VIZ_WORDS ((COLNO + 63) / 64)
+#define viz_bit(col) (UINT64_C(1) << ((col) & 63))
+
+static uint64_t viz_clear_bits[ROWNO][VIZ_WORDS];
+
 static char left_ptrs[ROWNO][COLNO];    /* LOS algorithm helpers */
 static char right_ptrs[ROWNO][COLNO];
 
+/*
+ * viz_clear_gen changes whenever viz_clear does.  last_recalc describes the
+ * last vision_recalc() that took the normal path (sighted, on an ordinary
+ * level, not engulfed, in a pit, underwater or using xray vision); it's what
+ * vision_recalc(1) builds on.
+ */
+static unsigned long viz_clear_gen;
+static struct {
+    boolean valid;
+    int ux, uy;
+    int nv_range;
+    unsigned long clear_gen;
+} last_recalc;
+
+/*
+ * los_cache remembers the results of clear_path() between locations other than
+ * the hero's.  It's direct-mapped on a hash of the endpoints; an entry is only
+ * good while its gen matches viz_clear_gen.  los_stats counts lookups, and
+ * the paths that had to be drawn because the entry wasn't there.
+ */
+#define LOS_CACHE_BITS 12
+static struct los_entry {
+    uint32_t key;       /* endpoints, packed */
+    unsigned long gen;  /* viz_clear_gen when it was made */
+    boolean clear;      /* the result */
+} los_cache[1 << LOS_CACHE_BITS];
+static struct {
+    unsigned long lookups;
+    unsigned long paths;
+} los_stats;
+
 /* Forward declarations. */
 static void fill_point(int, int);
 static void dig_point(int, int);
@@ -97,6 +142,8 @@ static void view_from(int, int, char **, char *, char *, int,
                       void (*)(int, int, void *), void *);
 static void get_unused_cs(char ***, char **, char **);
 static void rogue_vision(char **, char *, char *);
+static uint64_t range_bits(int, int, int);
+static boolean clear_run(int, int, int);
 
 /* Macro definitions that I can't find anywhere. */
 #define sign(z) ((z) < 0 ? -1 : ((z) ? 1 : 0 ))
@@ -188,6 +235,8 @@ vision_reset(void)
 
     /* Reset the pointers and clear so that we have a "full" dungeon. */
     memset(viz_clear, 0, sizeof (viz_clear));
+    viz_clear_gen++;
+    last_recalc.valid = FALSE;
 
     /* Dig the level */
     for (y = 0; y < ROWNO; y++) {
@@ -223,6 +272,11 @@ vision_reset(void)
             right_ptrs[y][i] = (COLNO - 1);
             viz_clear[y][i] = !block;
         }
+
+        memset(viz_clear_bits[y], 0, sizeof (viz_clear_bits[y]));
+        for (x = 0; x < COLNO; x++)
+            if (viz_clear[y][x])
+                viz_clear_bits[y][x >> 6] |= viz_bit(x);
     }
 
     turnstate.vision_full_recalc = TRUE;    /* we want to run vision_recalc() */
@@ -434,6 +488,125 @@ new_angle(struct rm *loc, unsigned char *sv, int row, int col)
 #endif
 
 
+/*
+ * Word operations on bit-packed rows.
+ *
+ * range_bits()      - The bits of word w that stand for columns lo to hi
+ *                     (inclusive).
+ * clear_run()       - Returns true if every location from lo to hi on the row
+ *                     is clear.  An empty range is clear.
+ * pack_unchanged()  - Sets the bit for each column where the two vision rows
+ *                     agree on all of the given flags.
+ * run_end()         - Returns the first column after col whose bit is not set,
+ *                     or stop + 1 if there isn't one by then.
+ */
+static uint64_t
+range_bits(int w, int lo, int hi)
+{
+    uint64_t bits = ~UINT64_C(0);
+
+    if (lo > (w << 6) + 63 || hi < (w << 6))
+        return 0;
+    if (lo > (w << 6))
+        bits <<= lo & 63;
+    if (hi < (w << 6) + 63)
+        bits &= ~UINT64_C(0) >> (63 - (hi & 63));
+    return bits;
+}
+
+static boolean
+clear_run(int row, int lo, int hi)
+{
+    int w;
+    uint64_t bits;
+
+    if (lo > hi)
+        return TRUE;
+    for (w = lo >> 6; w <= hi >> 6; w++) {
+        bits = range_bits(w, lo, hi);
+        if ((viz_clear_bits[row][w] & bits) != bits)
+            return FALSE;
+    }
+    return TRUE;
+}
+
+#ifdef __SSE2__
+static void
+pack_unchanged(const char *a, const char *b, char flags, uint64_t *bits)
+{
+    __m128i vflags = _mm_set1_epi8(flags);
+    __m128i zero = _mm_setzero_si128();
+    int i;
+
+    memset(bits, 0, VIZ_WORDS * sizeof (uint64_t));
+    for (i = 0; i + 16 <= COLNO; i += 16) {
+        __m128i va = _mm_loadu_si128((const __m128i *)(a + i));
+        __m128i vb = _mm_loadu_si128((const __m128i *)(b + i));
+        __m128i diff = _mm_and_si128(_mm_xor_si128(va, vb), vflags);
+        unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(diff, zero));
+
+        bits[i >> 6] |= (uint64_t)mask << (i & 63);
+    }
+    for (; i < COLNO; i++)
+        if (!((a[i] ^ b[i]) & flags))
+            bits[i >> 6] |= viz_bit(i);
+}
+#else
+static void
+pack_unchanged(const char *a, const char *b, char flags, uint64_t *bits)
+{
+    int i;
+
+    memset(bits, 0, VIZ_WORDS * sizeof (uint64_t));
+    for (i = 0; i < COLNO; i++)
+        if (!((a[i] ^ b[i]) & flags))
+            bits[i >> 6] |= viz_bit(i);
+}
+#endif
+
+static int
+run_end(const uint64_t *bits, int col, int stop)
+{
+    int w = col >> 6;
+    uint64_t unset = ~bits[w] & (~UINT64_C(0) << (col & 63));
+
+    while (!unset) {
+        if (++w == VIZ_WORDS)
+            return stop + 1;
+        unset = ~bits[w];
+    }
+#ifdef __GNUC__
+    col = (w << 6) + __builtin_ctzll(unset);
+#else
+    for (col = w << 6; !(unset & 1); unset >>= 1)
+        col++;
+#endif
+    return min(col, stop + 1);
+}
+
+
+#ifdef VISION_CHECK_ADJACENT
+/*
+ * Check that a location skipped by vision_recalc(1) is one that the full
+ * update would have left alone.  Walls and doors are never skipped, so
+ * the location is in sight if it could be seen and is lit.
+ */
+static void
+check_adjacent_skip(char next, char old, struct rm *loc,
+                    const unsigned char *sv, int row, int col)
+{
+    boolean in_sight = (next & IN_SIGHT) ||
+        ((next & COULD_SEE) && (loc->lit || (next & TEMP_LIT)));
+
+    if (!in_sight != !(old & IN_SIGHT) ||
+        (in_sight && (loc->seenv | new_angle(loc, sv, row, col)) !=
+         loc->seenv) ||
+        (!in_sight && (next & COULD_SEE) && loc->waslit))
+        impossible("vision_recalc(1) skipped changed location (%d, %d)",
+                   col, row);
+}
+#endif
+
 /*
  * vision_recalc()
  *
@@ -460,9 +633,19 @@ new_angle(struct rm *loc, unsigned char *sv, int row, int col)
  *     + Screen redraw, so we can renew all positions in sight. [doredraw()]
  *
  * Control flag = 1.  An adjacent vision recalculation.  The hero has moved
- * one square.  Knowing this, it might be possible to optimize the vision
- * recalculation using the current knowledge.  This is presently unimplemented
- * and is treated as a control = 0 call.
+ * one square.  The could see array still has to be generated from scratch
+ * (whether a location can be seen depends on the paths to it from the hero's
+ * exact position), but most locations that could be seen before and still
+ * can, and are lit the same way, look the same as before, and so keep their
+ * previous in sight bit without being examined.  The exceptions are the
+ * hero's old and new rows and columns (where the angle things are seen from
+ * changes), the area covered by night vision, and walls and doors (which
+ * depend on the location in front of them).  If the previous recalculation
+ * can't be built on --- it wasn't a normal sighted one, it was made from
+ * somewhere that isn't adjacent, the hero's vision has changed, or something
+ * has blocked or unblocked a location since --- this is treated as a
+ * control = 0 call.  Defining VISION_CHECK_ADJACENT makes it check each
+ * location it skips against what a full recalculation would have done.
  *
  *     + Right after the hero moves. [domove()]
  *
@@ -497,11 +680,28 @@ vision_recalc(int control)
     static unsigned char colbump[COLNO + 1];    /* cols to bump sv */
     const unsigned char *sv;  /* ptr to seen angle bits */
     int oldseenv;       /* previous seenv value */
-
+    boolean normal;     /* vision works in the ordinary way */
+    boolean adjacent;   /* can build on the previous recalculation */
+    boolean row_full;   /* must check every location on the row */
+    int band_lo, band_hi;       /* columns that must always be checked */
+    int nv_lo, nv_hi;   /* columns night vision might have changed */
+    int nv_top, nv_bottom;      /* rows night vision might have changed */
+    uint64_t skip[VIZ_WORDS];   /* packed row of locations to leave alone */
+    int w, end;
+
+    adjacent = control == 1 && !turnstate.vision_full_recalc;
     turnstate.vision_full_recalc = FALSE;     /* reset flag */
     if (in_mklev)
         return;
 
+    normal = !Engulfed && control != 2 && !Blind && !Is_rogue_level(&u.uz) &&
+        !(Underwater && !Is_waterlevel(&u.uz)) &&
+        !(u.utrap && u.utraptype == TT_PIT) && !Xray_vision;
+    adjacent = adjacent && normal && last_recalc.valid &&
+        last_recalc.clear_gen == viz_clear_gen &&
+        last_recalc.nv_range == u.nv_range &&
+        v_abs(last_recalc.ux - u.ux) <= 1 && v_abs(last_recalc.uy - u.uy) <= 1;
+
     /* 
      * Either the light sources have been taken care of, or we must
      * recalculate them here.
@@ -549,6 +749,7 @@ vision_recalc(int control)
         }
 
         /* skip the normal update loop */
+        last_recalc.valid = FALSE;
         goto skip;
     } else if (Is_rogue_level(&u.uz)) {
         rogue_vision(next_array, next_rmin, next_rmax);
@@ -684,12 +885,23 @@ vision_recalc(int control)
      *      Even so, that is not entirely correct.  But it seems close
      *      enough for now.
      */
+    if (adjacent) {
+        band_lo = min(last_recalc.ux, u.ux);
+        band_hi = max(last_recalc.ux, u.ux);
+        nv_lo = band_lo - max(u.nv_range, 0);
+        nv_hi = band_hi + max(u.nv_range, 0);
+        nv_top = min(last_recalc.uy, u.uy) - max(u.nv_range, 0);
+        nv_bottom = max(last_recalc.uy, u.uy) + max(u.nv_range, 0);
+    } else
+        band_lo = band_hi = nv_lo = nv_hi = nv_top = nv_bottom = 0;
+
     colbump[u.ux] = colbump[u.ux + 1] = 1;
     for (row = 0; row < ROWNO; row++) {
         dy = u.uy - row;
         dy = sign(dy);
         next_row = next_array[row];
         old_row = temp_array[row];
+        row_full = !adjacent || row == u.uy || row == last_recalc.uy;
 
         /* Find the min and max positions on the row. */
         start = min(viz_rmin[row], next_rmin[row]);
@@ -698,8 +910,42 @@ vision_recalc(int control)
 
         sv = &seenv_matrix[dy + 1][start < u.ux ? 0 : (start > u.ux ? 2 : 1)];
 
+        /* 
+         * In an adjacent recalculation, a location that could be seen and
+         * was lit the same way last time, and that the hero's move doesn't
+         * affect, is seen (or not) just as it was.  Work out which those are
+         * a word at a time.
+         */
+        if (!row_full) {
+            pack_unchanged(old_row, next_row, COULD_SEE | TEMP_LIT, skip);
+            for (w = 0; w < VIZ_WORDS; w++) {
+                skip[w] &= viz_clear_bits[row][w] &
+                    ~range_bits(w, band_lo, band_hi);
+                if (row >= nv_top && row <= nv_bottom)
+                    skip[w] &= ~range_bits(w, nv_lo, nv_hi);
+            }
+        }
+
         for (col = start; col <= stop;
              loc += ROWNO, sv += (int)colbump[++col]) {
+            if (!row_full && (skip[col >> 6] & viz_bit(col))) {
+                end = run_end(skip, col, stop);
+#ifdef VISION_CHECK_ADJACENT
+                for (w = col; w < end; w++)
+                    check_adjacent_skip(next_row[w], old_row[w],
+                                        &level->locations[w][row],
+                                        &seenv_matrix[dy + 1]
+                                        [w < u.ux ? 0 : (w > u.ux ? 2 : 1)],
+                                        row, w);
+#endif
+                memcpy(next_row + col, old_row + col, end - col);
+                col = end - 1;
+                loc = &level->locations[col][row];
+                sv = &seenv_matrix[dy + 1]
+                    [col < u.ux ? 0 : (col > u.ux ? 2 : 1)];
+                continue;
+            }
+
             oldseenv = loc->seenv;
             if (next_row[col] & IN_SIGHT) {
                 /* 
@@ -755,6 +1001,12 @@ vision_recalc(int control)
     }   /* end for row . .  */
     colbump[u.ux] = colbump[u.ux + 1] = 0;
 
+    last_recalc.valid = normal;
+    last_recalc.ux = u.ux;
+    last_recalc.uy = u.uy;
+    last_recalc.nv_range = u.nv_range;
+    last_recalc.clear_gen = viz_clear_gen;
+
 skip:
     /* This newsym() caused a crash delivering msg about failure to open
        dungeon file:
@@ -773,6 +1025,20 @@ skip:
 }
 
 
+/*
+ * vision_clear_gen()
+ *
+ * Returns a number that changes whenever a location on the current level
+ * starts or stops blocking light, or a new level's vision is set up.  Callers
+ * can keep results that only depend on what blocks light until it changes.
+ */
+unsigned long
+vision_clear_gen(void)
+{
+    return viz_clear_gen;
+}
+
+
 /*
  * block_point()
  *
@@ -870,6 +1136,8 @@ dig_point(int row, int col)
         return; /* already done */
 
     viz_clear[row][col] = 1;
+    viz_clear_bits[row][col >> 6] |= viz_bit(col);
+    viz_clear_gen++;
 
     /* 
      * Boundary cases first.
@@ -955,6 +1223,8 @@ fill_point(int row, int col)
         return;
 
     viz_clear[row][col] = 0;
+    viz_clear_bits[row][col >> 6] &= ~viz_bit(col);
+    viz_clear_gen++;
 
     if (col == 0) {
         if (viz_clear[row][1]) {        /* adjacent is clear */
@@ -1295,11 +1565,17 @@ q3_path(int srow, int scol, int y2, int x2)
  *
  * In order to make this function more usable to callers, it can be given
  * invalid coordinates as input, in which case it will simply return FALSE.
+ *
+ * Monsters ask about the same paths many times a turn, so paths that need
+ * drawing are remembered in los_cache until viz_clear changes.  A path that
+ * doesn't involve the hero's location only depends on viz_clear.
  */
 boolean
 clear_path(int col1, int row1, int col2, int row2, char **couldsee_data)
 {
     int result;
+    uint32_t key;
+    struct los_entry *entry;
 
     if (!isok(col1, row1))
         return FALSE;
@@ -1313,6 +1589,18 @@ clear_path(int col1, int row1, int col2, int row2, char **couldsee_data)
     else if (col2 == u.ux && row2 == u.uy && couldsee_data)
         return !!(couldsee_data[row1][col1] & COULD_SEE);
 
+    /* A path along a row can be checked a word at a time. */
+    if (row1 == row2)
+        return clear_run(row1, min(col1, col2) + 1, max(col1, col2) - 1);
+
+    /* Rows differ, so an unused (zeroed) entry never matches. */
+    key = (((uint32_t)col1 * ROWNO + row1) * COLNO + col2) * ROWNO + row2;
+    entry = &los_cache[(key * UINT32_C(2654435761)) >> (32 - LOS_CACHE_BITS)];
+    los_stats.lookups++;
+    if (entry->key == key && entry->gen == viz_clear_gen)
+        return entry->clear;
+    los_stats.paths++;
+
     if (col1 < col2) {
         if (row1 > row2) {
             result = q1_path(row1, col1, row2, col2);
@@ -1328,10 +1616,26 @@ clear_path(int col1, int row1, int col2, int row2, char **couldsee_data)
             result = q3_path(row1, col1, row2, col2);
         }
     }
+
+    entry->key = key;
+    entry->gen = viz_clear_gen;
+    entry->clear = !!result;
     return (boolean) result;
 }
 
 
+/*
+ * Report how many paths clear_path() has looked up in los_cache, and how many
+ * of those it had to draw.
+ */
+void
+clear_path_stats(unsigned long *lookups, unsigned long *paths)
+{
+    *lookups = los_stats.lookups;
+    *paths = los_stats.paths;
+}
+
+
 /*===========================================================================*\
                             GENERAL LINE OF SIGHT
                                 Algorithm C
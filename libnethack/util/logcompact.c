@@ -0,0 +1,99 @@
+/* vim:set cin ft=c sw=4 sts=4 ts=8 et ai cino=Ls\:0t0(0 : -*- mode:c;fill-column:80;tab-width:8;c-basic-offset:4;indent-tabs-mode:nil;c-file-style:"k&r" -*-*/
+/* NetHack may be freely redistributed.  See license for details. */
+
+/* logcompact: rewrites the logs of finished games so that they're smaller and
+   quicker to replay; see nh_compact_log in log.c for details. */
+
+#ifdef AIMAKE_BUILDOS_MSWin32
+# error !AIMAKE_FAIL_SILENTLY! Log compaction on Windows is not yet supported.
+#endif
+
+#include "nethack.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+static void
+usage(void)
+{
+    fprintf(stderr, "Usage: logcompact [-s seek-cost-KiB] logfile...\n");
+    fprintf(stderr, "Each logfile is replaced with a compacted version.\n");
+    fprintf(stderr, "By default, save backups are placed so that seeking\n");
+    fprintf(stderr, "never decodes more save diffs than one save's worth.\n");
+    exit(2);
+}
+
+/* Compacts one logfile, writing the result next to it, then moving it into
+   place only once it's complete. */
+static int
+compact_file(const char *filename, long seek_cost)
+{
+    char *tmpname = malloc(strlen(filename) + sizeof ".compact");
+    const char *error;
+    int infd, outfd;
+    struct stat st;
+
+    infd = open(filename, O_RDWR);
+    if (infd < 0) {
+        fprintf(stderr, "%s: %s\n", filename, strerror(errno));
+        free(tmpname);
+        return 0;
+    }
+
+    strcpy(tmpname, filename);
+    strcat(tmpname, ".compact");
+    outfd = open(tmpname, O_RDWR | O_CREAT | O_EXCL, 0660);
+    if (outfd >= 0 && fstat(infd, &st) == 0)
+        fchmod(outfd, st.st_mode & 07777);
+    if (outfd < 0) {
+        fprintf(stderr, "%s: %s\n", tmpname, strerror(errno));
+        close(infd);
+        free(tmpname);
+        return 0;
+    }
+
+    error = nh_compact_log(infd, outfd, seek_cost);
+    if (!error && fsync(outfd) != 0)
+        error = strerror(errno);
+    if (!error && rename(tmpname, filename) != 0)
+        error = strerror(errno);
+
+    close(outfd);
+    close(infd);
+
+    if (error) {
+        fprintf(stderr, "%s: %s\n", filename, error);
+        unlink(tmpname);
+    }
+
+    free(tmpname);
+    return !error;
+}
+
+int
+main(int argc, char **argv)
+{
+    long seek_cost = 0;
+    int i = 1, failures = 0;
+
+    if (i + 1 < argc && !strcmp(argv[i], "-s")) {
+        char *end;
+        seek_cost = strtol(argv[i + 1], &end, 10) * 1024;
+        if (*end || seek_cost <= 0)
+            usage();
+        i += 2;
+    }
+
+    if (i >= argc)
+        usage();
+
+    for (; i < argc; i++)
+        if (!compact_file(argv[i], seek_cost))
+            failures++;
+
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
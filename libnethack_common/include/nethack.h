@@ -41,6 +41,15 @@ extern const_char_p_const_p EXPORT(nh_get_copyright_banner) (void);
 /* log.c */
 extern enum nh_log_status EXPORT(nh_get_savegame_status) (
     int fd, struct nh_game_info *si);
+extern void EXPORT(nh_set_save_verification) (
+    enum nh_save_verification policy, int interval);
+extern void EXPORT(nh_set_replay_cache_size) (long kilobytes);
+extern void EXPORT(nh_set_log_index_fd) (int fd);
+extern const_char_p EXPORT(nh_compact_log) (int infd, int outfd,
+                                            long seek_cost);
+extern void EXPORT(nh_set_save_timing_callback) (
+    void (*callback)(enum nh_save_phase phase, long long nanoseconds,
+                     long bytes));
 
 /* cmd.c */
 extern nh_cmd_desc_p EXPORT(nh_get_commands) (int *count);
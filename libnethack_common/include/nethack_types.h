@@ -368,6 +368,27 @@ enum nh_log_status {
     LS_IN_PROGRESS      /* locking issues trying to obtain save information */
 };
 
+/* How thoroughly each new save in the log is checked (by loading it back in and
+   saving it again) before play continues. */
+enum nh_save_verification {
+    SAVEVERIFY_ALWAYS,  /* every save, before the next command (default) */
+    SAVEVERIFY_PERIODIC,/* every N turns, and whenever the level changes */
+    SAVEVERIFY_ASYNC,   /* in a background process, reported next turn */
+    SAVEVERIFY_PARANOID,/* as always, and also cross-check the save caches */
+};
+
+/* Phases of save handling that can be timed, for benchmarking. */
+enum nh_save_phase {
+    SAVEPHASE_SAVEGAME,  /* producing a save from the gamestate */
+    SAVEPHASE_DORECOVER, /* loading the gamestate from a save */
+    SAVEPHASE_DIFF,      /* finishing the encoding of a save diff */
+    SAVEPHASE_DIFFAPPLY, /* applying a save diff */
+    SAVEPHASE_MEQUAL,    /* comparing two saves */
+    SAVEPHASE_BASE64,    /* base 64 encoding or decoding */
+    SAVEPHASE_ZLIB,      /* compression or decompression */
+    SAVEPHASE_COUNT
+};
+
 enum autopickup_action {
     AP_GRAB,
     AP_LEAVE
@@ -681,6 +702,13 @@ struct nh_dbuf_entry {
     nh_bool visible;    /* can the hero see this location? */
 };
 
+/* a changed position in the display buffer, passed by
+   win_update_screen_delta */
+struct nh_dbuf_delta {
+    int x, y;
+    struct nh_dbuf_entry entry;
+};
+
 # define NH_EFFECT_TYPE(e) ((enum nh_effect_types)((e) >> 16))
 # define NH_EFFECT_ID(e) (((e) - 1) & 0xffff)
 
@@ -843,6 +871,14 @@ struct nh_window_procs {
                         nh_bool tombstone, const char *name, int gold,
                         const char *killbuf, int end_how, int year);
     void (*win_server_cancel) (void);
+
+    /* Optional; may be NULL, in which case win_update_screen is used. If it's
+       set, the game calls this instead of win_update_screen, with just the
+       positions that have changed since the last call (possibly none). The
+       first call it gets in a game, and any call after the screen has been
+       cleared, covers every position. */
+    void (*win_update_screen_delta) (const struct nh_dbuf_delta *cells,
+                                     int ncells, int ux, int uy);
 };
 
 /* typedefs for import/export */
@@ -57,6 +57,9 @@ struct settings {
     char *workdir;
     char *pidfile;
     int client_timeout;
+    enum nh_save_verification save_verification;
+    int save_verification_interval;
+    long replay_cache_size;
     char *dbhost, *dbname, *dbport, *dbuser, *dbpass;
 };
 
@@ -289,8 +289,8 @@ static const char *const play_status_names[] = {
 static void
 ccmd_play_game(json_t * params)
 {
-    int gid, fd, status, followmode;
-    char filename[1024];
+    int gid, fd, indexfd, status, followmode;
+    char filename[1024], indexname[1024 + sizeof ".idx"];
     enum getgame_result ggr;
     struct nh_game_info unused;
     enum nh_log_status logstatus;
@@ -335,11 +335,22 @@ ccmd_play_game(json_t * params)
 
     log_msg("User '%s' started to %s game %d, file %s",
             user_info.username, verb, gid, filename);
+    /* Keep the log's seek index next to it, so that loading it again can
+       skip straight to the right part of the log. This is only an
+       optimization, so it doesn't matter if the file can't be opened. */
+    snprintf(indexname, sizeof indexname, "%s.idx", filename);
+    indexfd = open(indexname, O_RDWR | O_CREAT, 0600);
+    nh_set_log_index_fd(indexfd);
+
     gameid = gid;
     gamefd = fd;
     status = nh_play_game(fd, followmode);
     gameid = -1;
     gamefd = -1;
+
+    nh_set_log_index_fd(-1);
+    if (indexfd != -1)
+        close(indexfd);
     log_msg("User '%s' stopped %sing game %d, file %s: %s",
             user_info.username, verb, gid, filename, play_status_names[status]);
 
@@ -362,6 +362,10 @@ client_main(int userid, int _infd, int _outfd)
 
     gamepaths = init_game_paths();
     nh_lib_init(&server_windowprocs, (const char *const *)gamepaths);
+    nh_set_save_verification(settings.save_verification,
+                             settings.save_verification_interval);
+    if (settings.replay_cache_size)
+        nh_set_replay_cache_size(settings.replay_cache_size);
     for (i = 0; i < PREFIX_COUNT; i++)
         free(gamepaths[i]);
     free(gamepaths);
@@ -97,8 +97,37 @@ parse_config_line(char *line)
                     " range [30, 86400].\n");
             return FALSE;
         }
-    }
-    else
+    } else if (!strcmp(line, "save_verification")) {
+        if (!strcmp(val, "always"))
+            settings.save_verification = SAVEVERIFY_ALWAYS;
+        else if (!strcmp(val, "periodic"))
+            settings.save_verification = SAVEVERIFY_PERIODIC;
+        else if (!strcmp(val, "async"))
+            settings.save_verification = SAVEVERIFY_ASYNC;
+        else if (!strcmp(val, "paranoid"))
+            settings.save_verification = SAVEVERIFY_PARANOID;
+        else {
+            fprintf(stderr, "Error: the value for save_verification must be"
+                    " one of always, periodic, async, paranoid.\n");
+            return FALSE;
+        }
+    } else if (!strcmp(line, "save_verification_interval")) {
+        settings.save_verification_interval = atoi(val);
+
+        if (settings.save_verification_interval < 1) {
+            fprintf(stderr, "Error: the value for save_verification_interval"
+                    " must be positive.\n");
+            return FALSE;
+        }
+    } else if (!strcmp(line, "replay_cache_size")) {
+        settings.replay_cache_size = atol(val);
+
+        if (settings.replay_cache_size < 1) {
+            fprintf(stderr, "Error: the value for replay_cache_size (in"
+                    " kilobytes) must be positive.\n");
+            return FALSE;
+        }
+    } else
         /* it's a warning, no need to return FALSE */
         fprintf(stderr, "Warning: unrecognized option \"%s\".\n", line);
 
@@ -15,6 +15,10 @@ static void srv_update_status(struct nh_player_info *pi);
 static void srv_print_message(enum msg_channel msgc, const char *msg);
 static void srv_update_screen(struct nh_dbuf_entry dbuf[ROWNO][COLNO], int ux,
                               int uy);
+static void srv_update_screen_delta(const struct nh_dbuf_delta *cells,
+                                    int ncells, int ux, int uy);
+static void send_screen(struct nh_dbuf_entry dbuf[ROWNO][COLNO], int ux,
+                        int uy, const nh_bool *changed_cols);
 static void srv_delay_output(void);
 static void srv_load_progress(int progress);
 static void srv_level_changed(int displaymode);
@@ -46,6 +50,7 @@ static void srv_server_cancel(void);
 
 struct nh_player_info player_info;
 static struct nh_dbuf_entry prev_dbuf[ROWNO][COLNO];
+static struct nh_dbuf_entry cur_dbuf[ROWNO][COLNO];    /* built from deltas */
 static int prev_invent_icount, prev_floor_icount;
 static struct nh_objitem *prev_invent;
 static const struct nh_dbuf_entry zero_dbuf;    /* an entry of all zeroes */
@@ -72,6 +77,7 @@ struct nh_window_procs server_windowprocs = {
     srv_level_changed,
     srv_outrip,
     srv_server_cancel,
+    srv_update_screen_delta,
 };
 
 /*---------------------------------------------------------------------------*/
@@ -294,6 +300,33 @@ srv_print_message(enum msg_channel msgc, const char *msg)
 
 static void
 srv_update_screen(struct nh_dbuf_entry dbuf[ROWNO][COLNO], int ux, int uy)
+{
+    send_screen(dbuf, ux, uy, NULL);
+}
+
+
+static void
+srv_update_screen_delta(const struct nh_dbuf_delta *cells, int ncells,
+                        int ux, int uy)
+{
+    nh_bool changed_cols[COLNO] = {0};
+    int i;
+
+    for (i = 0; i < ncells; i++) {
+        memcpy(&cur_dbuf[cells[i].y][cells[i].x], &cells[i].entry,
+               sizeof (cells[i].entry));
+        changed_cols[cells[i].x] = TRUE;
+    }
+
+    send_screen(cur_dbuf, ux, uy, changed_cols);
+}
+
+
+/* Send the map to the client. If changed_cols isn't NULL, columns for which it
+   is FALSE are known to be the same as last time and aren't looked at. */
+static void
+send_screen(struct nh_dbuf_entry dbuf[ROWNO][COLNO], int ux, int uy,
+            const nh_bool *changed_cols)
 {
     int i, x, y, samedbe, samecols, zerodbe, zerocols, is_same, is_zero;
     json_t *jmsg, *jdbuf, *dbufcol, *dbufent;
@@ -302,6 +335,12 @@ srv_update_screen(struct nh_dbuf_entry dbuf[ROWNO][COLNO], int ux, int uy)
     zerocols = 0;
     jdbuf = json_array();
     for (x = 0; x < COLNO; x++) {
+        if (changed_cols && !changed_cols[x]) {
+            samecols++;
+            json_array_append_new(jdbuf, json_integer(1));
+            continue;
+        }
+
         samedbe = 0;
         zerodbe = 0;
         dbufcol = json_array();
@@ -729,6 +768,7 @@ reset_cached_displaydata(void)
 
     memset(&player_info, 0, sizeof (player_info));
     memset(&prev_dbuf, 0, sizeof (prev_dbuf));
+    memset(&cur_dbuf, 0, sizeof (cur_dbuf));
 }
 
 /* winprocs.c */
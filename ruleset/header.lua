@@ -31,17 +31,24 @@ end
 -- Random Functions --
 ----------------------
 
-math.randomseed(os.time())
+-- These roll on NetHack's own RNGs, via API.rn2, so that a game replays the
+-- same. Each takes an optional rng argument: hooks are passed the RNG they
+-- should roll on (the level generation RNG, for room hooks), and should pass
+-- it along. Without one, the main RNG is used.
 rng = {}
 
+-- The number of steps that rng.randuniform divides its interval into.
+rng.resolution = 0x40000000
+
 -- rng.randuniform
 -- Returns a uniformly distributed random variable on
 -- the interval [min,max).
 -- ARGS:
 --     min - The minimum value
 --     max - The maximum value
-function rng.randuniform(min,max)
-    s = math.random() -- TODO: Change to nethack rng call
+--     r   - The RNG to roll on
+function rng.randuniform(min,max,r)
+    local s = API.rn2(rng.resolution, r) / rng.resolution
     return (s * (max - min)) + min
 end
 
@@ -51,9 +58,10 @@ end
 -- ARGS:
 --      mean - The mean of the distribution
 --      dev  - The standard deviation of the distribution
-function rng.randn(mean, dev)
-    U1 = rng.randuniform(0,1)
-    U2 = rng.randuniform(0,1)
+--      r    - The RNG to roll on
+function rng.randn(mean, dev, r)
+    local U1 = 1 - rng.randuniform(0,1,r)
+    local U2 = rng.randuniform(0,1,r)
     return mean + dev * math.sqrt(-2.0 * math.log(U1)) * math.cos(2.0 * math.pi * U2)
 end
 
@@ -61,8 +69,9 @@ end
 -- Returns an exponentially distributed random variable
 -- ARGS:
 --      l - The rate parameter (lambda)
-function rng.randexp(l)
-    u = rng.randuniform(0,1)
+--      r - The RNG to roll on
+function rng.randexp(l, r)
+    local u = 1 - rng.randuniform(0,1,r)
     return -1.0 * math.log(u) / l
 end
 
@@ -72,8 +81,9 @@ end
 -- except that the rne in nethack is bounded to less than 10.
 -- ARGS:
 --      x - The x parameter of the nethack RNE function
-function rng.rne(x)
-    return 1 + math.floor(rng.randexp(math.log(x)))
+--      r - The RNG to roll on
+function rng.rne(x, r)
+    return 1 + math.floor(rng.randexp(math.log(x), r))
 end
 
 
@@ -82,23 +92,20 @@ end
 -- ARGS:
 --     p - The probability of returning true
 --         (range is 0 to 0.999...)
-function rng.chance(p)
-    q = rng.randuniform(0,1)
-    if p >= q then
-        return true
-    else
-        return false
-    end
+--     r - The RNG to roll on
+function rng.chance(p, r)
+    return rng.randuniform(0,1,r) < p
 end
 
 -- rng.onein
 -- Returns true 'one in N' times.
 -- ARGS:
 --     n - The N value
+--     r - The RNG to roll on
 -- EXAMPLE:
 --     rng.onein(4) returns true one in 4 times (25.00%)
-function rng.onein(n)
-    return rng.chance(1.0 / n)
+function rng.onein(n, r)
+    return API.rn2(n, r) == 0
 end
 
 -- rng.round
@@ -110,7 +117,7 @@ end
 --      Average = 2.3
 -- ARGS:
 --      n - The value to round
-function rng.round(n)
-    return math.floor(n + rng.randuniform(0,1))
+--      r - The RNG to roll on
+function rng.round(n, r)
+    return math.floor(n + rng.randuniform(0,1,r))
 end
-
@@ -17,40 +17,33 @@
 
 room = {}
 
--- room.gen_altar
--- Probability that an altar will generate in a room.
+-- Room contents are generated natively from these tunables. To replace
+-- one with a script, define the corresponding function instead:
+--     room.gen_altar(rng), room.gen_fountain(rng), room.gen_sink(rng)
+--         Return true if the room gets that feature.
+--     room.number_of_items(size_x, size_y, z, rng)
+--         Return the number of items in the room (z is the dungeon level,
+--         higher number => deeper).
+-- rng identifies the level generation RNG that the native versions roll on;
+-- pass it to API.rn2 or the rng.* helpers. (Call the parameter something
+-- else, so as not to hide the rng table: e.g.
+--     function room.gen_altar(r) return rng.onein(60, r) end
+-- rolls like the native version.)
+
+-- Chance (1 in N) that a room has an altar.
 -- Default: 1 in 60
-function room.gen_altar()
-    return rng.onein(15)
-end
-
-function room.gen_fountain()
-    return rng.onein(10)
-end
-
-function room.gen_sink()
-    return rng.onein(60)
-end
-
--- room.number_of_items
--- The number of items in a room.
--- ARGS:
---      size_x - The horizontal size of the room
---      size_y - The vertical size of the room
---      z      - The dungeon level (higher number => deeper)
--- RETURNS:
---      The number of items in that will be in the room.
---
--- Default: if rng.onein(3) then return rng.rne(5) else return 0 end
---          default value has a mean of 0.42 items per room
-function room.number_of_items(size_x, size_y, z)
-    if rng.onein(3) then return rng.rne(5) else return 0 end
-end
-
-
-
-
-
+room.altar_chance = 15
 
+-- Chance (1 in N) that a room has a fountain.
+-- Default: 1 in 10
+room.fountain_chance = 10
 
+-- Chance (1 in N) that a room has a sink.
+-- Default: 1 in 60
+room.sink_chance = 60
 
+-- A room has items 1 in room.item_chance times; it then has 1 item, plus
+-- another each time a 1 in room.item_rne chance comes up.
+-- Default: 1 in 3, then 1 in 5 (a mean of 0.42 items per room)
+room.item_chance = 3
+room.item_rne = 5
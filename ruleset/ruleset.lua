@@ -13,16 +13,9 @@
 
 -- ruleset.lua
 
--- hp_loss_modifier
--- ARGS:
---      n
---          The amount of damage.
---          This number is positive.
---  RETURNS:
---      The amount of damage done.
+-- hp_loss_factor
+-- Damage taken by the player is multiplied by this, rounded, and is always
+-- at least 1. The game applies it natively; to do something more complex,
+-- define hp_loss_modifier(n) instead, which takes the amount of damage
+-- (positive) and returns the amount of damage done.
 hp_loss_factor = 0.5
-function hp_loss_modifier(n) 
-    n = math.round(n * hp_loss_factor)
-    if n < 1 then n = 1 end
-    return n
-end
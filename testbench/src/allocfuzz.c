@@ -0,0 +1,142 @@
+/* vim:set cin ft=c sw=4 sts=4 ts=8 et ai cino=Ls\:0t0(0 : -*- mode:c;fill-column:80;tab-width:8;c-basic-offset:4;indent-tabs-mode:nil;c-file-style:"k&r" -*-*/
+/* NetHack may be freely redistributed.  See license for details. */
+
+/* A randomized test of the allocator that libnethack gives to Lua. Blocks are
+   allocated, resized and freed at random, with sizes on both sides of the
+   pooled size classes; each block is filled with a byte that identifies it,
+   so that if two blocks ever overlap, or resizing loses data, the contents
+   won't match. Afterwards, everything is freed, and the memory limit must
+   still be exactly where it started. */
+
+#include "tap.h"
+#include "script.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#define SLOTS 2000
+#define OPERATIONS 1000000
+
+static unsigned long long rng_state;
+
+static unsigned long
+fuzz_rand(void)
+{
+    /* xorshift64*, so that a seed means the same thing everywhere */
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return (rng_state * 2685821657736338717ULL) >> 33;
+}
+
+static bool
+block_holds(const unsigned char *block, size_t size, unsigned char tag)
+{
+    size_t i;
+
+    for (i = 0; i < size; i++)
+        if (block[i] != tag)
+            return false;
+    return true;
+}
+
+int
+main(int argc, char **argv)
+{
+    static unsigned char *blocks[SLOTS];
+    static size_t sizes[SLOTS];
+    static unsigned char tags[SLOTS];
+    unsigned long long seed = time(NULL);
+    long errors = 0, first_error = -1;
+    int testnumber = 1;
+    long op;
+    int i;
+    void *limit_block;
+    bool all_passed;
+
+    if (argc > 1)
+        seed = strtoull(argv[1], NULL, 10);
+    rng_state = seed ? seed : 1;
+
+    tap_init(3);
+    tap_comment("seed %llu", seed);
+
+    for (op = 0; op < OPERATIONS; op++) {
+        size_t nsize;
+        unsigned char *newblock;
+
+        i = fuzz_rand() % SLOTS;
+        /* Mostly pooled sizes, some just past the pool, and some frees. */
+        if (fuzz_rand() % 4 == 0)
+            nsize = fuzz_rand() % 2000;
+        else
+            nsize = fuzz_rand() % 300;
+
+        /* Lua passes a type code as the old size of a new block. */
+        newblock = script_alloc(NULL, blocks[i], blocks[i] ? sizes[i] : 5,
+                                nsize);
+        if (nsize == 0) {
+            blocks[i] = NULL;
+            sizes[i] = 0;
+            continue;
+        }
+        if (!newblock)
+            tap_bail("the allocator failed well under the memory limit");
+
+        if (!block_holds(newblock, sizes[i] < nsize ? sizes[i] : nsize,
+                         tags[i])) {
+            if (first_error < 0)
+                first_error = op;
+            errors++;
+        }
+
+        tags[i] = fuzz_rand();
+        memset(newblock, tags[i], nsize);
+        blocks[i] = newblock;
+        sizes[i] = nsize;
+
+        /* Check every block now and then, to catch a block being trampled
+           by a different one. */
+        if (op % (OPERATIONS / 10) == 0) {
+            int j;
+
+            for (j = 0; j < SLOTS; j++)
+                if (blocks[j] && !block_holds(blocks[j], sizes[j], tags[j])) {
+                    if (first_error < 0)
+                        first_error = op;
+                    errors++;
+                }
+        }
+    }
+    if (errors)
+        tap_comment("%ld corrupted blocks, first seen at operation %ld",
+                    errors, first_error);
+    tap_test(&testnumber, !errors, "block contents survive resizing");
+    all_passed = !errors;
+
+    for (i = 0; i < SLOTS; i++) {
+        if (blocks[i])
+            script_alloc(NULL, blocks[i], sizes[i], 0);
+        blocks[i] = NULL;
+    }
+
+    limit_block = script_alloc(NULL, NULL, 5, DEFAULT_LUA_MEMORY_LIMIT + 1);
+    tap_test(&testnumber, !limit_block, "allocations over the limit fail");
+    if (limit_block) {
+        script_alloc(NULL, limit_block, DEFAULT_LUA_MEMORY_LIMIT + 1, 0);
+        all_passed = false;
+    }
+
+    /* If freeing left anything counted, this will go over the limit. */
+    limit_block = script_alloc(NULL, NULL, 5, DEFAULT_LUA_MEMORY_LIMIT);
+    tap_test(&testnumber, limit_block != NULL,
+             "freeing everything returns the usage to zero");
+    if (limit_block)
+        script_alloc(NULL, limit_block, DEFAULT_LUA_MEMORY_LIMIT, 0);
+    else
+        all_passed = false;
+
+    /* Exit with failure too, so that "make check" notices. */
+    return all_passed ? 0 : EXIT_FAILURE;
+}
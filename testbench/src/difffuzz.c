@@ -0,0 +1,264 @@
+/* vim:set cin ft=c sw=4 sts=4 ts=8 et ai cino=Ls\:0t0(0 : -*- mode:c;fill-column:80;tab-width:8;c-basic-offset:4;indent-tabs-mode:nil;c-file-style:"k&r" -*-*/
+/* NetHack may be freely redistributed.  See license for details. */
+
+/* A randomized differential test of the save diff encoder. mwrite works out
+   the diff a run of equal or differing bytes at a time; a single-byte mwrite
+   can only ever see one byte, so it behaves exactly like the old bytewise
+   encoder, which serves as the reference. Each trial makes a random "old
+   save" and a random mutation of it (with edits, insertions, deletions, tags
+   and monster coordinate hints in the mix), writes the mutation both ways,
+   and checks that the diffs are byte-for-byte the same, and that applying the
+   diff to the old save gives back the new one. */
+
+#include "hack.h"
+#include "tap.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <setjmp.h>
+
+#define TRIALS 3000
+#define MAX_SAVE 4096
+
+static unsigned long long rng_state;
+
+static unsigned long
+fuzz_rand(void)
+{
+    /* xorshift64*, so that a seed means the same thing everywhere */
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return (rng_state * 2685821657736338717ULL) >> 33;
+}
+
+/* A small alphabet, so that the old and new saves often agree by chance, as
+   real saves (mostly small integers and zeroes) do. */
+static char
+fuzz_byte(void)
+{
+    return fuzz_rand() % 4 ? (char)(fuzz_rand() % 4) : (char)fuzz_rand();
+}
+
+/* What to do to a memfile: write some bytes, or tag the current position, or
+   hint that a monster's coordinates are next. */
+enum fuzz_op_type { FUZZ_WRITE, FUZZ_TAG, FUZZ_HINT };
+struct fuzz_op {
+    enum fuzz_op_type type;
+    int start, len;     /* FUZZ_WRITE: range of the data */
+    long tag;           /* FUZZ_TAG */
+};
+
+/* Every write op is at least a byte of the new save, so this is plenty. */
+static struct fuzz_op ops[MAX_SAVE * 4];
+static int op_count;
+static char newdata[MAX_SAVE * 2];
+static int newlen;
+
+static void
+add_op(enum fuzz_op_type type, int start, int len, long tag)
+{
+    if (op_count == (int)(sizeof ops / sizeof *ops))
+        tap_bail("too many operations in one trial");
+    ops[op_count].type = type;
+    ops[op_count].start = start;
+    ops[op_count].len = len;
+    ops[op_count].tag = tag;
+    op_count++;
+}
+
+/* Builds the old save into base, and the script for writing the new one into
+   ops and newdata. Both consist of chunks, most of which start with a tag;
+   the new save copies, edits, skips or adds chunks. */
+static void
+make_trial(struct memfile *base)
+{
+    int chunks = fuzz_rand() % 40, c;
+    char chunk[MAX_SAVE / 40];
+
+    op_count = 0;
+    newlen = 0;
+
+    for (c = 0; c < chunks; c++) {
+        int len = 1 + fuzz_rand() % (sizeof chunk - 1), i;
+        boolean tagged = fuzz_rand() % 4 != 0;
+
+        for (i = 0; i < len; i++)
+            chunk[i] = fuzz_byte();
+
+        if (tagged)
+            mtag(base, c, MTAG_OBJ);
+        mwrite(base, chunk, len);
+
+        /* Sometimes the chunk isn't in the new save at all; sometimes a new
+           chunk appears before it. */
+        if (fuzz_rand() % 8 == 0)
+            continue;
+        if (fuzz_rand() % 8 == 0) {
+            int extra = 1 + fuzz_rand() % 64;
+
+            add_op(FUZZ_TAG, 0, 0, chunks + c);
+            for (i = 0; i < extra; i++)
+                newdata[newlen + i] = fuzz_byte();
+            add_op(FUZZ_WRITE, newlen, extra, 0);
+            newlen += extra;
+        }
+
+        if (tagged)
+            add_op(FUZZ_TAG, 0, 0, c);
+
+        /* Runs of edits, and changes of length, within the chunk. */
+        for (i = 0; i < len;) {
+            int run = 1 + fuzz_rand() % 32, j;
+            int what = fuzz_rand() % 8;
+
+            if (run > len - i)
+                run = len - i;
+            if (what == 0) {
+                for (j = 0; j < run; j++)
+                    newdata[newlen + j] = fuzz_byte();
+            } else if (what == 1) {
+                i += run;       /* deleted */
+                continue;
+            } else {
+                memcpy(newdata + newlen, chunk + i, run);
+                if (what == 2)
+                    newdata[newlen + fuzz_rand() % run] ^= 1;
+            }
+            if (fuzz_rand() % 16 == 0)
+                add_op(FUZZ_HINT, 0, 0, 0);
+            /* Split the data into writes of varying sizes, as savegame's
+               mwrite8 .. mwrite64 and mwrite calls do. */
+            while (run) {
+                int w = 1 + fuzz_rand() % 24;
+
+                if (w > run)
+                    w = run;
+                add_op(FUZZ_WRITE, newlen, w, 0);
+                newlen += w;
+                i += w;
+                run -= w;
+            }
+        }
+    }
+}
+
+/* Writes the new save into mf, relative to base; if bytewise is set, every
+   write is split into single bytes. */
+static void
+write_trial(struct memfile *mf, struct memfile *base, boolean bytewise)
+{
+    int i, j;
+
+    mnew(mf, base);
+    for (i = 0; i < op_count; i++) {
+        switch (ops[i].type) {
+        case FUZZ_WRITE:
+            if (bytewise)
+                for (j = 0; j < ops[i].len; j++)
+                    mwrite(mf, newdata + ops[i].start + j, 1);
+            else
+                mwrite(mf, newdata + ops[i].start, ops[i].len);
+            break;
+        case FUZZ_TAG:
+            mtag(mf, ops[i].tag, MTAG_OBJ);
+            break;
+        case FUZZ_HINT:
+            mhint_mon_coordinates(mf);
+            break;
+        }
+    }
+    mdiffflush(mf, 1);
+}
+
+/* mdiffapply can't continue after an error, so we jump out of it. */
+static jmp_buf diff_error_jmp;
+static const char *diff_error;
+
+static noreturn void
+fuzz_diff_error(const char *message, char *diff)
+{
+    (void) diff;
+    diff_error = message;
+    longjmp(diff_error_jmp, 1);
+}
+
+/* Checks that applying mf's diff to base gives the new save in newdata. */
+static boolean
+diff_applies(struct memfile *mf, struct memfile *base)
+{
+    static struct memfile applied;  /* static, as it outlives the setjmp */
+    boolean ok;
+
+    diff_error = NULL;
+    mnew(&applied, NULL);
+    if (setjmp(diff_error_jmp)) {
+        mfree(&applied);
+        return FALSE;
+    }
+    mdiffapply(mf->diffbuf, mf->diffpos, base, &applied, fuzz_diff_error);
+    ok = applied.pos == newlen &&
+        (!newlen || !memcmp(applied.buf, newdata, newlen));
+    mfree(&applied);
+    return ok;
+}
+
+int
+main(int argc, char **argv)
+{
+    unsigned long long seed = time(NULL);
+    int testnumber = 1;
+    int trial, mismatches = 0, bad_applies = 0;
+    int first_mismatch = -1, first_bad_apply = -1;
+
+    if (argc > 1)
+        seed = strtoull(argv[1], NULL, 10);
+    rng_state = seed ? seed : 1;
+
+    tap_init(2);
+    tap_comment("seed %llu", seed);
+
+    for (trial = 0; trial < TRIALS; trial++) {
+        struct memfile base, runwise, bytewise;
+
+        mnew(&base, NULL);
+        make_trial(&base);
+        write_trial(&runwise, &base, FALSE);
+        write_trial(&bytewise, &base, TRUE);
+
+        if (runwise.diffpos != bytewise.diffpos ||
+            memcmp(runwise.diffbuf, bytewise.diffbuf, runwise.diffpos)) {
+            if (first_mismatch < 0)
+                first_mismatch = trial;
+            mismatches++;
+        }
+
+        if (!diff_applies(&runwise, &base)) {
+            if (first_bad_apply < 0) {
+                first_bad_apply = trial;
+                if (diff_error)
+                    tap_comment("mdiffapply: %s", diff_error);
+            }
+            bad_applies++;
+        }
+
+        mfree(&bytewise);
+        mfree(&runwise);
+        mfree(&base);
+    }
+
+    if (mismatches)
+        tap_comment("%d of %d diffs differ, the first in trial %d",
+                    mismatches, TRIALS, first_mismatch);
+    tap_test(&testnumber, !mismatches,
+             "run-based diffs match the bytewise encoder");
+    if (bad_applies)
+        tap_comment("%d of %d diffs don't apply, the first in trial %d",
+                    bad_applies, TRIALS, first_bad_apply);
+    tap_test(&testnumber, !bad_applies,
+             "applying each diff gives back the new save");
+
+    /* Exit with failure too, so that "make check" notices. */
+    return mismatches || bad_applies ? EXIT_FAILURE : 0;
+}
@@ -134,6 +134,9 @@ init_test_system(unsigned long long seed, const char crga[static 4],
     };
 
     nh_lib_init(&test_windowprocs, paths);
+
+    /* Check everything the save code can, including its caches. */
+    nh_set_save_verification(SAVEVERIFY_PARANOID, 0);
 }
 
 void